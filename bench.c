@@ -0,0 +1,415 @@
+/* Copyright © 2024 Jakub Wilk <jwilk@jwilk.net>
+ * SPDX-License-Identifier: MIT
+ */
+
+/* Benchmark paskuda under a pseudo-terminal.
+ *
+ * Usage: paskuda-bench [-n ITERATIONS] [PROGRAM]
+ *
+ * Latencies are measured from the moment the input is written to the
+ * pty master until the expected output arrives. Syscalls are counted in an
+ * extra, ptrace()d run of each scenario, over the same window: from the
+ * input until paskuda blocks again. */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <pty.h>
+#include <sys/ptrace.h>
+#else
+#include <util.h>
+#endif
+
+static const char *program = "./paskuda";
+static const char *hint = "(press TAB for no echo) ";
+
+#define KEYSTROKES 100
+
+static void xerror(const char *context)
+{
+    perror(context);
+    exit(EXIT_FAILURE);
+}
+
+static int64_t now_ns()
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        xerror("clock_gettime()");
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct session {
+    pid_t pid;
+    int master;
+    int out; /* the secret */
+    size_t out_len;
+    int traced;
+    long stops;
+    int exited;
+    char *seen; /* terminal output since the last mark */
+    size_t seen_len;
+    size_t seen_size;
+};
+
+static void start(struct session *s, const char *term, int traced)
+{
+    int pipefd[2];
+    if (pipe(pipefd) < 0)
+        xerror("pipe()");
+    struct winsize ws = { .ws_row = 24, .ws_col = 80 };
+    s->pid = forkpty(&s->master, NULL, NULL, &ws);
+    if (s->pid < 0)
+        xerror("forkpty()");
+    if (s->pid == 0) {
+        dup2(pipefd[1], STDOUT_FILENO);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        setenv("TERM", term, 1);
+#ifdef __linux__
+        if (traced && ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0)
+            xerror("ptrace(PTRACE_TRACEME)");
+#endif
+        execl(program, program, "--max-size=4M", (char *)NULL);
+        xerror(program);
+    }
+    close(pipefd[1]);
+    s->out = pipefd[0];
+    s->out_len = 0;
+    s->traced = traced;
+    s->stops = 0;
+    s->exited = 0;
+    s->seen_len = 0;
+    if (fcntl(s->master, F_SETFL, O_NONBLOCK) < 0 || fcntl(s->out, F_SETFL, O_NONBLOCK) < 0)
+        xerror("fcntl()");
+#ifdef __linux__
+    if (traced) {
+        int status;
+        /* the stop after execve() */
+        if (waitpid(s->pid, &status, 0) < 0)
+            xerror("waitpid()");
+        if (ptrace(PTRACE_SETOPTIONS, s->pid, NULL, (void *)PTRACE_O_TRACESYSGOOD) < 0)
+            xerror("ptrace(PTRACE_SETOPTIONS)");
+        if (ptrace(PTRACE_SYSCALL, s->pid, NULL, NULL) < 0)
+            xerror("ptrace(PTRACE_SYSCALL)");
+    }
+#endif
+}
+
+/* Let the traced process go on to its next syscall. */
+static void trace(struct session *s)
+{
+#ifdef __linux__
+    int status;
+    pid_t pid;
+    if (!s->traced)
+        return;
+    while (!s->exited && (pid = waitpid(s->pid, &status, WNOHANG)) > 0) {
+        if (!WIFSTOPPED(status)) {
+            s->exited = 1;
+            break;
+        }
+        int sig = WSTOPSIG(status);
+        if (sig == (SIGTRAP | 0x80)) {
+            s->stops++;
+            sig = 0;
+        }
+        if (ptrace(PTRACE_SYSCALL, pid, NULL, (void *)(intptr_t)sig) < 0)
+            xerror("ptrace(PTRACE_SYSCALL)");
+    }
+#else
+    (void) s;
+#endif
+}
+
+static void mark(struct session *s)
+{
+    s->seen_len = 0;
+}
+
+static void drain(struct session *s)
+{
+    while (1) {
+        if (s->seen_size - s->seen_len < 4096) {
+            s->seen_size = s->seen_size ? s->seen_size * 2 : 65536;
+            s->seen = realloc(s->seen, s->seen_size);
+            if (s->seen == NULL)
+                xerror("realloc()");
+        }
+        ssize_t n = read(s->master, s->seen + s->seen_len, s->seen_size - s->seen_len);
+        if (n <= 0)
+            break;
+        s->seen_len += n;
+    }
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(s->out, buf, sizeof buf)) > 0)
+        s->out_len += n;
+    if (n == 0 && !s->traced)
+        s->exited = 1;
+}
+
+/* Write the input, and wait until the output ends with what is expected
+ * (if anything), or until the process exits (if done is set). Return the
+ * time at which that happened. */
+static int64_t pump(struct session *s, const char *in, size_t in_len, const char *expect, size_t expect_len, int done)
+{
+    const int64_t deadline = now_ns() + INT64_C(30) * 1000000000;
+    while (1) {
+        trace(s);
+        drain(s);
+        if (in_len == 0) {
+            if (expect && s->seen_len >= expect_len
+                && memcmp(s->seen + s->seen_len - expect_len, expect, expect_len) == 0)
+                return now_ns();
+            if (done && s->exited)
+                return now_ns();
+        }
+        if (now_ns() > deadline) {
+            fprintf(stderr, "paskuda-bench: timed out\n");
+            exit(EXIT_FAILURE);
+        }
+        struct pollfd pfd[] = {
+            { .fd = s->master, .events = POLLIN | (in_len > 0 ? POLLOUT : 0) },
+            { .fd = s->out, .events = POLLIN },
+        };
+        if (poll(pfd, 2, s->traced ? 1 : 100) < 0 && errno != EINTR)
+            xerror("poll()");
+        if (in_len > 0 && (pfd[0].revents & POLLOUT)) {
+            ssize_t n = write(s->master, in, in_len);
+            if (n < 0 && errno != EAGAIN && errno != EINTR)
+                xerror("write()");
+            if (n > 0) {
+                in += n;
+                in_len -= n;
+            }
+        }
+    }
+}
+
+/* Let a traced process run until it blocks, i.e. until it stops making
+ * syscalls for a while. */
+static void settle(struct session *s)
+{
+    if (!s->traced)
+        return;
+    long stops = -1;
+    while (stops != s->stops && !s->exited) {
+        stops = s->stops;
+        const int64_t until = now_ns() + 20 * 1000000;
+        while (now_ns() < until && !s->exited) {
+            trace(s);
+            drain(s);
+            poll(NULL, 0, 1);
+        }
+    }
+}
+
+/* A measurement window: elapsed time, or (when traced) the number of
+ * syscalls made. */
+static int64_t window_start(struct session *s)
+{
+    return s->traced ? s->stops : now_ns();
+}
+
+static int64_t window_end(struct session *s, int64_t start, int64_t t)
+{
+    if (!s->traced)
+        return t - start;
+    settle(s);
+    /* a stop on entry and one on exit, except for exit_group() */
+    return (s->stops - start + 1) / 2;
+}
+
+static void finish(struct session *s)
+{
+    pump(s, NULL, 0, NULL, 0, 1);
+    int status;
+    if (!s->traced && waitpid(s->pid, &status, 0) < 0)
+        xerror("waitpid()");
+    close(s->master);
+    close(s->out);
+    free(s->seen);
+}
+
+static void type_keys(struct session *s, int64_t *samples)
+{
+    for (int i = 0; i < KEYSTROKES; i++) {
+        mark(s);
+        const int64_t start = window_start(s);
+        const int64_t t = pump(s, "x", 1, "*", 1, 0);
+        samples[i] = window_end(s, start, t);
+    }
+}
+
+enum scenario {
+    SCENARIO_PROMPT,
+    SCENARIO_KEYS,
+    SCENARIO_ERASE,
+    SCENARIO_PASTE,
+};
+
+/* Run a scenario once, and put the measurements into samples:
+ * one per keystroke for SCENARIO_KEYS, otherwise just one.
+ * For SCENARIO_PASTE, the input (terminated by a newline) is measured until
+ * paskuda acknowledges the end of line. */
+static void run(enum scenario scenario, const char *term, const char *paste, size_t paste_len,
+    int traced, int64_t *samples)
+{
+    struct session s = { 0 };
+    int64_t t0 = now_ns();
+    start(&s, term, traced);
+    if (traced)
+        t0 = 0;
+    int64_t t = pump(&s, NULL, 0, hint, strlen(hint), 0);
+    int64_t result = window_end(&s, t0, t);
+    int64_t key_samples[KEYSTROKES];
+    int64_t begin;
+    switch (scenario) {
+    case SCENARIO_PROMPT:
+        break;
+    case SCENARIO_KEYS:
+        type_keys(&s, samples);
+        break;
+    case SCENARIO_ERASE:
+        type_keys(&s, key_samples);
+        mark(&s);
+        char expect[3 * KEYSTROKES + 1];
+        size_t expect_len = 0;
+        if (strcmp(term, "dumb") == 0)
+            for (int i = 0; i < KEYSTROKES; i++) {
+                memcpy(expect + expect_len, "\b \b", 3);
+                expect_len += 3;
+            }
+        else
+            expect_len = snprintf(expect, sizeof expect, "\033[%dD\033[K", KEYSTROKES);
+        begin = window_start(&s);
+        t = pump(&s, "\025", 1, expect, expect_len, 0);
+        result = window_end(&s, begin, t);
+        break;
+    case SCENARIO_PASTE:
+        mark(&s);
+        begin = window_start(&s);
+        t = pump(&s, paste, paste_len, "\r\n", 2, 0);
+        result = window_end(&s, begin, t);
+        break;
+    }
+    if (scenario != SCENARIO_PASTE)
+        pump(&s, "\n", 1, NULL, 0, 1);
+    finish(&s);
+    if (scenario == SCENARIO_PASTE && s.out_len != paste_len - 1) {
+        fprintf(stderr, "paskuda-bench: got %zu bytes instead of %zu\n", s.out_len, paste_len - 1);
+        exit(EXIT_FAILURE);
+    }
+    if (scenario != SCENARIO_KEYS)
+        samples[0] = result;
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    const int64_t x = *(const int64_t *)a;
+    const int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int64_t percentile(int64_t *samples, size_t n, int p)
+{
+    qsort(samples, n, sizeof *samples, cmp_int64);
+    size_t i = (n * p + 99) / 100;
+    if (i > 0)
+        i--;
+    return samples[i];
+}
+
+/* Run the scenario, and print the percentiles, the median number of
+ * syscalls and, for pastes, the throughput. */
+static void measure(const char *name, int iterations, enum scenario scenario, const char *term,
+    const char *paste, size_t paste_len)
+{
+    const size_t per_run = scenario == SCENARIO_KEYS ? KEYSTROKES : 1;
+    const size_t n = iterations * per_run;
+    int64_t *samples = malloc(n * sizeof *samples);
+    if (samples == NULL)
+        xerror("malloc()");
+    for (int i = 0; i < iterations; i++)
+        run(scenario, term, paste, paste_len, 0, samples + i * per_run);
+    const int64_t p50 = percentile(samples, n, 50);
+    const int64_t p99 = percentile(samples, n, 99);
+    printf("%-28s %9.3f ms %9.3f ms", name, p50 / 1e6, p99 / 1e6);
+#ifdef __linux__
+    run(scenario, term, paste, paste_len, 1, samples);
+    printf(" %9" PRId64, percentile(samples, per_run, 50));
+#else
+    printf(" %9s", "-");
+#endif
+    if (scenario == SCENARIO_PASTE)
+        printf(" %9.2f MiB/s", (paste_len - 1) / (1024.0 * 1024.0) / (p50 / 1e9));
+    printf("\n");
+    fflush(stdout);
+    free(samples);
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = 20;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1)
+        switch (opt) {
+        case 'n':
+            iterations = atoi(optarg);
+            if (iterations < 1) {
+                fprintf(stderr, "paskuda-bench: bad number of iterations\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: paskuda-bench [-n ITERATIONS] [PROGRAM]\n");
+            exit(EXIT_FAILURE);
+        }
+    if (optind < argc)
+        program = argv[optind];
+    signal(SIGPIPE, SIG_IGN);
+    printf("%-28s %12s %12s %9s %15s\n", "", "p50", "p99", "syscalls", "throughput");
+    measure("exec to prompt", iterations, SCENARIO_PROMPT, "xterm", NULL, 0);
+    measure("keystroke to echo", iterations, SCENARIO_KEYS, "xterm", NULL, 0);
+    static const char *terms[] = { "xterm", "dumb" };
+    for (size_t t = 0; t < sizeof terms / sizeof *terms; t++) {
+        char name[64];
+        snprintf(name, sizeof name, "^U erase, %d chars (%s)", KEYSTROKES, terms[t]);
+        measure(name, iterations, SCENARIO_ERASE, terms[t], NULL, 0);
+    }
+    static const size_t paste_sizes[] = { 64, 4 << 10, 1 << 20 };
+    for (size_t p = 0; p < sizeof paste_sizes / sizeof *paste_sizes; p++) {
+        const size_t size = paste_sizes[p];
+        const size_t len = size + 1;
+        char *paste = malloc(len);
+        if (paste == NULL)
+            xerror("malloc()");
+        memset(paste, 'a', size);
+        paste[size] = '\n';
+        char name[64];
+        if (size >= 1 << 20)
+            snprintf(name, sizeof name, "paste %zu MiB", size >> 20);
+        else if (size >= 1 << 10)
+            snprintf(name, sizeof name, "paste %zu KiB", size >> 10);
+        else
+            snprintf(name, sizeof name, "paste %zu B", size);
+        measure(name, iterations, SCENARIO_PASTE, "xterm", paste, len);
+        free(paste);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* vim:set ts=4 sts=4 sw=4 et:*/
@@ -0,0 +1,536 @@
+/* Copyright © 2024 Jakub Wilk <jwilk@jwilk.net>
+ * SPDX-License-Identifier: MIT
+ */
+
+/* SHA-256 (FIPS 180-4), and Argon2id (RFC 9106) on top of BLAKE2b (RFC 7693).
+ * Everything derived from the password is wiped before returning. */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "hash.h"
+#include "paskuda.h"
+#include "util.h"
+
+static uint32_t load32_be(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void store32_be(unsigned char *p, uint32_t x)
+{
+    for (int i = 3; i >= 0; i--, x >>= 8)
+        p[i] = x;
+}
+
+static uint64_t load64_le(const unsigned char *p)
+{
+    uint64_t x = 0;
+    for (int i = 7; i >= 0; i--)
+        x = x << 8 | p[i];
+    return x;
+}
+
+static void store64_le(unsigned char *p, uint64_t x)
+{
+    for (int i = 0; i < 8; i++, x >>= 8)
+        p[i] = x;
+}
+
+static uint32_t ror32(uint32_t x, int n)
+{
+    return x >> n | x << (32 - n);
+}
+
+static uint64_t ror64(uint64_t x, int n)
+{
+    return x >> n | x << (64 - n);
+}
+
+/* SHA-256
+ * ======= */
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static void sha256_block(uint32_t h[8], const unsigned char *p)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = load32_be(p + 4 * i);
+    for (int i = 16; i < 64; i++) {
+        const uint32_t s0 = ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        const uint32_t s1 = ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 64; i++) {
+        const uint32_t t1 = k + (ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        const uint32_t t2 = (ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += k;
+    paskuda_wipe(w, sizeof w);
+}
+
+void sha256(const void *data, size_t len, unsigned char digest[SHA256_SIZE])
+{
+    uint32_t h[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    const unsigned char *p = data;
+    size_t n = len;
+    for (; n >= 64; p += 64, n -= 64)
+        sha256_block(h, p);
+    unsigned char tail[128] = { 0 };
+    memcpy(tail, p, n);
+    tail[n] = 0x80;
+    const size_t tail_len = n < 56 ? 64 : 128;
+    const uint64_t bits = (uint64_t)len * 8;
+    store32_be(tail + tail_len - 8, bits >> 32);
+    store32_be(tail + tail_len - 4, bits);
+    for (size_t i = 0; i < tail_len; i += 64)
+        sha256_block(h, tail + i);
+    for (int i = 0; i < 8; i++)
+        store32_be(digest + 4 * i, h[i]);
+    paskuda_wipe(tail, sizeof tail);
+    paskuda_wipe(h, sizeof h);
+}
+
+/* BLAKE2b
+ * ======= */
+
+static const uint64_t blake2b_iv[8] = {
+    0x6a09e667f3bcc908, 0xbb67ae8584caa73b, 0x3c6ef372fe94f82b, 0xa54ff53a5f1d36f1,
+    0x510e527fade682d1, 0x9b05688c2b3e6c1f, 0x1f83d9abfb41bd6b, 0x5be0cd19137e2179,
+};
+
+static const unsigned char blake2b_sigma[12][16] = {
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
+    { 11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4 },
+    { 7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8 },
+    { 9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13 },
+    { 2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9 },
+    { 12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11 },
+    { 13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10 },
+    { 6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5 },
+    { 10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0 },
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
+};
+
+struct blake2b {
+    uint64_t h[8];
+    uint64_t t; /* inputs are way below 2^64 bytes */
+    unsigned char buf[128];
+    size_t buf_len;
+    size_t out_len;
+};
+
+#define BLAKE2B_G(a, b, c, d, x, y) \
+    do { \
+        a = a + b + (x); \
+        d = ror64(d ^ a, 32); \
+        c = c + d; \
+        b = ror64(b ^ c, 24); \
+        a = a + b + (y); \
+        d = ror64(d ^ a, 16); \
+        c = c + d; \
+        b = ror64(b ^ c, 63); \
+    } while (0)
+
+static void blake2b_compress(struct blake2b *S, int last)
+{
+    uint64_t m[16], v[16];
+    for (int i = 0; i < 16; i++)
+        m[i] = load64_le(S->buf + 8 * i);
+    for (int i = 0; i < 8; i++) {
+        v[i] = S->h[i];
+        v[i + 8] = blake2b_iv[i];
+    }
+    v[12] ^= S->t;
+    if (last)
+        v[14] = ~v[14];
+    for (int r = 0; r < 12; r++) {
+        const unsigned char *s = blake2b_sigma[r];
+        BLAKE2B_G(v[0], v[4], v[8], v[12], m[s[0]], m[s[1]]);
+        BLAKE2B_G(v[1], v[5], v[9], v[13], m[s[2]], m[s[3]]);
+        BLAKE2B_G(v[2], v[6], v[10], v[14], m[s[4]], m[s[5]]);
+        BLAKE2B_G(v[3], v[7], v[11], v[15], m[s[6]], m[s[7]]);
+        BLAKE2B_G(v[0], v[5], v[10], v[15], m[s[8]], m[s[9]]);
+        BLAKE2B_G(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);
+        BLAKE2B_G(v[2], v[7], v[8], v[13], m[s[12]], m[s[13]]);
+        BLAKE2B_G(v[3], v[4], v[9], v[14], m[s[14]], m[s[15]]);
+    }
+    for (int i = 0; i < 8; i++)
+        S->h[i] ^= v[i] ^ v[i + 8];
+    paskuda_wipe(m, sizeof m);
+    paskuda_wipe(v, sizeof v);
+}
+
+static void blake2b_init(struct blake2b *S, size_t out_len)
+{
+    memcpy(S->h, blake2b_iv, sizeof S->h);
+    S->h[0] ^= 0x01010000 ^ out_len;
+    S->t = 0;
+    S->buf_len = 0;
+    S->out_len = out_len;
+}
+
+static void blake2b_update(struct blake2b *S, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    while (len > 0) {
+        /* the last block is compressed only in blake2b_final() */
+        if (S->buf_len == sizeof S->buf) {
+            S->t += sizeof S->buf;
+            blake2b_compress(S, 0);
+            S->buf_len = 0;
+        }
+        size_t n = sizeof S->buf - S->buf_len;
+        if (n > len)
+            n = len;
+        memcpy(S->buf + S->buf_len, p, n);
+        S->buf_len += n;
+        p += n;
+        len -= n;
+    }
+}
+
+static void blake2b_update32(struct blake2b *S, uint32_t x)
+{
+    unsigned char buf[4];
+    store32_le(buf, x);
+    blake2b_update(S, buf, sizeof buf);
+}
+
+static void blake2b_final(struct blake2b *S, void *out)
+{
+    S->t += S->buf_len;
+    memset(S->buf + S->buf_len, 0, sizeof S->buf - S->buf_len);
+    blake2b_compress(S, 1);
+    unsigned char buf[64];
+    for (int i = 0; i < 8; i++)
+        store64_le(buf + 8 * i, S->h[i]);
+    memcpy(out, buf, S->out_len);
+    paskuda_wipe(buf, sizeof buf);
+    paskuda_wipe(S, sizeof *S);
+}
+
+/* the variable-length hash function H' */
+static void blake2b_long(void *out, size_t out_len, const void *in, size_t in_len)
+{
+    unsigned char *p = out;
+    struct blake2b S;
+    blake2b_init(&S, out_len <= 64 ? out_len : 64);
+    blake2b_update32(&S, out_len);
+    blake2b_update(&S, in, in_len);
+    if (out_len <= 64) {
+        blake2b_final(&S, p);
+        return;
+    }
+    unsigned char v[64];
+    blake2b_final(&S, v);
+    memcpy(p, v, 32);
+    p += 32;
+    out_len -= 32;
+    while (out_len > 64) {
+        blake2b_init(&S, 64);
+        blake2b_update(&S, v, sizeof v);
+        blake2b_final(&S, v);
+        memcpy(p, v, 32);
+        p += 32;
+        out_len -= 32;
+    }
+    blake2b_init(&S, out_len);
+    blake2b_update(&S, v, sizeof v);
+    blake2b_final(&S, p);
+    paskuda_wipe(v, sizeof v);
+}
+
+/* Argon2id
+ * ======== */
+
+#define ARGON2_VERSION 0x13
+#define ARGON2_TYPE_ID 2
+#define ARGON2_SLICES 4
+#define ARGON2_QWORDS 128 /* per 1 KiB block */
+
+struct block {
+    uint64_t v[ARGON2_QWORDS];
+};
+
+struct argon2 {
+    struct block *memory;
+    uint32_t passes;
+    uint32_t lanes;
+    uint32_t blocks; /* m', rounded down to a multiple of 4 * lanes */
+    uint32_t lane_length;
+    uint32_t segment_length;
+};
+
+/* one segment: the work of one thread between two synchronization points */
+struct segment {
+    const struct argon2 *ctx;
+    uint32_t pass;
+    uint32_t lane;
+    uint32_t slice;
+};
+
+static uint64_t blamka(uint64_t x, uint64_t y)
+{
+    return x + y + 2 * (uint64_t)(uint32_t)x * (uint32_t)y;
+}
+
+#define ARGON2_G(a, b, c, d) \
+    do { \
+        a = blamka(a, b); \
+        d = ror64(d ^ a, 32); \
+        c = blamka(c, d); \
+        b = ror64(b ^ c, 24); \
+        a = blamka(a, b); \
+        d = ror64(d ^ a, 16); \
+        c = blamka(c, d); \
+        b = ror64(b ^ c, 63); \
+    } while (0)
+
+#define ARGON2_P(v0, v1, v2, v3, v4, v5, v6, v7, v8, v9, v10, v11, v12, v13, v14, v15) \
+    do { \
+        ARGON2_G(v0, v4, v8, v12); \
+        ARGON2_G(v1, v5, v9, v13); \
+        ARGON2_G(v2, v6, v10, v14); \
+        ARGON2_G(v3, v7, v11, v15); \
+        ARGON2_G(v0, v5, v10, v15); \
+        ARGON2_G(v1, v6, v11, v12); \
+        ARGON2_G(v2, v7, v8, v13); \
+        ARGON2_G(v3, v4, v9, v14); \
+    } while (0)
+
+/* the compression function G; with_xor is for the passes after the first */
+static void fill_block(const struct block *prev, const struct block *ref, struct block *next, int with_xor)
+{
+    struct block r, z;
+    for (int i = 0; i < ARGON2_QWORDS; i++)
+        r.v[i] = prev->v[i] ^ ref->v[i];
+    z = r;
+    if (with_xor)
+        for (int i = 0; i < ARGON2_QWORDS; i++)
+            z.v[i] ^= next->v[i];
+    uint64_t *v = r.v;
+    for (int i = 0; i < 8; i++) {
+        uint64_t *q = v + 16 * i;
+        ARGON2_P(q[0], q[1], q[2], q[3], q[4], q[5], q[6], q[7],
+            q[8], q[9], q[10], q[11], q[12], q[13], q[14], q[15]);
+    }
+    for (int i = 0; i < 8; i++) {
+        uint64_t *q = v + 2 * i;
+        ARGON2_P(q[0], q[1], q[16], q[17], q[32], q[33], q[48], q[49],
+            q[64], q[65], q[80], q[81], q[96], q[97], q[112], q[113]);
+    }
+    for (int i = 0; i < ARGON2_QWORDS; i++)
+        next->v[i] = z.v[i] ^ r.v[i];
+}
+
+static void next_addresses(struct block *address, struct block *input, const struct block *zero)
+{
+    input->v[6]++;
+    fill_block(zero, input, address, 0);
+    fill_block(zero, address, address, 0);
+}
+
+/* Map the pseudo-random value to a block of the reference lane. */
+static uint32_t index_alpha(const struct segment *seg, uint32_t index, uint32_t pseudo_rand, int same_lane)
+{
+    const struct argon2 *ctx = seg->ctx;
+    uint32_t area;
+    if (seg->pass == 0 && seg->slice == 0)
+        area = index - 1;
+    else {
+        area = seg->pass == 0
+            ? seg->slice * ctx->segment_length
+            : ctx->lane_length - ctx->segment_length;
+        if (same_lane)
+            area += index - 1;
+        else if (index == 0)
+            area--;
+    }
+    uint64_t pos = pseudo_rand;
+    pos = pos * pos >> 32;
+    pos = area - 1 - ((uint64_t)area * pos >> 32);
+    uint32_t start = 0;
+    if (seg->pass != 0 && seg->slice != ARGON2_SLICES - 1)
+        start = (seg->slice + 1) * ctx->segment_length;
+    return (start + pos) % ctx->lane_length;
+}
+
+static void *fill_segment(void *arg)
+{
+    const struct segment *seg = arg;
+    const struct argon2 *ctx = seg->ctx;
+    struct block *memory = ctx->memory;
+    /* Argon2id: data-independent addressing in the first half of the first pass */
+    const int independent = seg->pass == 0 && seg->slice < ARGON2_SLICES / 2;
+    struct block address, input, zero;
+    if (independent) {
+        memset(&zero, 0, sizeof zero);
+        memset(&input, 0, sizeof input);
+        input.v[0] = seg->pass;
+        input.v[1] = seg->lane;
+        input.v[2] = seg->slice;
+        input.v[3] = ctx->blocks;
+        input.v[4] = ctx->passes;
+        input.v[5] = ARGON2_TYPE_ID;
+    }
+    uint32_t start = 0;
+    if (seg->pass == 0 && seg->slice == 0) {
+        /* the first two blocks are computed from H0 */
+        start = 2;
+        if (independent)
+            next_addresses(&address, &input, &zero);
+    }
+    uint32_t cur = seg->lane * ctx->lane_length + seg->slice * ctx->segment_length + start;
+    uint32_t prev = cur % ctx->lane_length == 0 ? cur + ctx->lane_length - 1 : cur - 1;
+    for (uint32_t i = start; i < ctx->segment_length; i++, cur++, prev++) {
+        if (cur % ctx->lane_length == 1)
+            prev = cur - 1;
+        uint64_t pseudo_rand;
+        if (independent) {
+            if (i % ARGON2_QWORDS == 0)
+                next_addresses(&address, &input, &zero);
+            pseudo_rand = address.v[i % ARGON2_QWORDS];
+        } else
+            pseudo_rand = memory[prev].v[0];
+        uint32_t ref_lane = (pseudo_rand >> 32) % ctx->lanes;
+        if (seg->pass == 0 && seg->slice == 0)
+            ref_lane = seg->lane;
+        const uint32_t ref = index_alpha(seg, i, pseudo_rand, ref_lane == seg->lane);
+        fill_block(memory + prev, memory + ctx->lane_length * ref_lane + ref, memory + cur, seg->pass > 0);
+    }
+    return NULL;
+}
+
+/* Fill one slice of all lanes, one thread per lane. */
+static void fill_slice(const struct argon2 *ctx, struct segment *segs, pthread_t *threads, uint32_t pass, uint32_t slice)
+{
+    for (uint32_t l = 0; l < ctx->lanes; l++) {
+        segs[l] = (struct segment) { .ctx = ctx, .pass = pass, .lane = l, .slice = slice };
+        /* the last lane, or any lane without a thread, is done here */
+        if (l + 1 == ctx->lanes || pthread_create(&threads[l], NULL, fill_segment, &segs[l]) != 0) {
+            threads[l] = pthread_self();
+            fill_segment(&segs[l]);
+        }
+    }
+    for (uint32_t l = 0; l < ctx->lanes; l++)
+        if (!pthread_equal(threads[l], pthread_self()))
+            pthread_join(threads[l], NULL);
+}
+
+int argon2id(const void *pwd, size_t pwd_len, const void *salt, size_t salt_len,
+    const struct argon2_params *params, void *tag, size_t tag_len)
+{
+    const uint32_t lanes = params->lanes;
+    if (lanes < 1 || lanes > 0xFFFFFF || params->t_cost < 1 || params->m_cost / 8 < lanes
+        || salt_len < 8 || tag_len < 4 || pwd_len > UINT32_MAX || salt_len > UINT32_MAX || tag_len > UINT32_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct argon2 ctx = {
+        .passes = params->t_cost,
+        .lanes = lanes,
+        .segment_length = params->m_cost / (lanes * ARGON2_SLICES),
+    };
+    ctx.lane_length = ctx.segment_length * ARGON2_SLICES;
+    ctx.blocks = ctx.lane_length * lanes;
+    const size_t size = (size_t)ctx.blocks * sizeof (struct block);
+    struct segment *segs = NULL;
+    pthread_t *threads = NULL;
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return -1;
+#ifdef MADV_DONTDUMP
+    madvise(memory, size, MADV_DONTDUMP);
+#endif
+    ctx.memory = memory;
+    segs = calloc(lanes, sizeof *segs);
+    threads = calloc(lanes, sizeof *threads);
+    if (segs == NULL || threads == NULL) {
+        free(segs);
+        free(threads);
+        munmap(memory, size);
+        errno = ENOMEM;
+        return -1;
+    }
+    unsigned char h0[64 + 8];
+    struct blake2b S;
+    blake2b_init(&S, 64);
+    blake2b_update32(&S, lanes);
+    blake2b_update32(&S, tag_len);
+    blake2b_update32(&S, params->m_cost);
+    blake2b_update32(&S, params->t_cost);
+    blake2b_update32(&S, ARGON2_VERSION);
+    blake2b_update32(&S, ARGON2_TYPE_ID);
+    blake2b_update32(&S, pwd_len);
+    blake2b_update(&S, pwd, pwd_len);
+    blake2b_update32(&S, salt_len);
+    blake2b_update(&S, salt, salt_len);
+    blake2b_update32(&S, 0); /* no secret key */
+    blake2b_update32(&S, 0); /* no associated data */
+    blake2b_final(&S, h0);
+    unsigned char bytes[sizeof (struct block)];
+    for (uint32_t l = 0; l < lanes; l++)
+        for (uint32_t j = 0; j < 2; j++) {
+            store32_le(h0 + 64, j);
+            store32_le(h0 + 68, l);
+            blake2b_long(bytes, sizeof bytes, h0, sizeof h0);
+            struct block *b = ctx.memory + l * ctx.lane_length + j;
+            for (int i = 0; i < ARGON2_QWORDS; i++)
+                b->v[i] = load64_le(bytes + 8 * i);
+        }
+    for (uint32_t pass = 0; pass < ctx.passes; pass++)
+        for (uint32_t slice = 0; slice < ARGON2_SLICES; slice++)
+            fill_slice(&ctx, segs, threads, pass, slice);
+    struct block *c = ctx.memory + ctx.lane_length - 1;
+    for (uint32_t l = 1; l < lanes; l++) {
+        const struct block *last = ctx.memory + l * ctx.lane_length + ctx.lane_length - 1;
+        for (int i = 0; i < ARGON2_QWORDS; i++)
+            c->v[i] ^= last->v[i];
+    }
+    for (int i = 0; i < ARGON2_QWORDS; i++)
+        store64_le(bytes + 8 * i, c->v[i]);
+    blake2b_long(tag, tag_len, bytes, sizeof bytes);
+    paskuda_wipe(bytes, sizeof bytes);
+    paskuda_wipe(h0, sizeof h0);
+    paskuda_wipe(memory, size);
+    munmap(memory, size);
+    free(segs);
+    free(threads);
+    return 0;
+}
+
+/* vim:set ts=4 sts=4 sw=4 et:*/
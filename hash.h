@@ -0,0 +1,28 @@
+/* Copyright © 2024 Jakub Wilk <jwilk@jwilk.net>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef PASKUDA_HASH_H
+#define PASKUDA_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_SIZE 32
+
+void sha256(const void *data, size_t len, unsigned char digest[SHA256_SIZE]);
+
+struct argon2_params {
+    uint32_t t_cost; /* passes */
+    uint32_t m_cost; /* memory, in KiB */
+    uint32_t lanes; /* each lane is filled by its own thread */
+};
+
+/* Derive tag_len bytes of Argon2id (version 1.3) into tag; there is no
+ * secret key or associated data. Return -1 and set errno on error. */
+int argon2id(const void *pwd, size_t pwd_len, const void *salt, size_t salt_len,
+    const struct argon2_params *params, void *tag, size_t tag_len);
+
+#endif
+
+/* vim:set ts=4 sts=4 sw=4 et:*/
@@ -0,0 +1,1453 @@
+/* Copyright © 2022-2024 Jakub Wilk <jwilk@jwilk.net>
+ * SPDX-License-Identifier: MIT
+ */
+
+#define __STDC_WANT_LIB_EXT1__ 1 /* memset_s() */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "paskuda.h"
+#include "util.h"
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 25))
+#define HAVE_EXPLICIT_BZERO 1
+#elif defined(__OpenBSD__) || defined(__FreeBSD__)
+#define HAVE_EXPLICIT_BZERO 1
+#endif
+
+#if !defined(HAVE_EXPLICIT_BZERO) && !defined(__STDC_LIB_EXT1__)
+typedef void *(*memset_fn) (void *s, int c, size_t n);
+static const volatile memset_fn xmemset = memset;
+#endif
+
+void paskuda_wipe(void *p, size_t n)
+{
+    if (n == 0)
+        return;
+#if defined(HAVE_EXPLICIT_BZERO)
+    explicit_bzero(p, n);
+#elif defined(__STDC_LIB_EXT1__)
+    memset_s(p, n, 0, n);
+#else
+    xmemset(p, 0, n);
+#endif
+}
+
+/* Statistics being collected, if any. Clock reads are the only cost of
+ * instrumentation, so they are skipped unless asked for. */
+static struct paskuda_stats *stats = NULL;
+static int64_t first_input_us;
+
+static void stats_input()
+{
+    if (stats && first_input_us == 0)
+        first_input_us = monotonic_us();
+}
+
+static long page_size = 0;
+
+/* Locked memory for secrets, kept out of the malloc arena.
+ *
+ * The whole ceiling is reserved up front as PROT_NONE, preceded by a guard
+ * page; growing makes more of it accessible and locks it in place, so the
+ * data never moves and the inaccessible remainder acts as the trailing
+ * guard. Madvise flags are set once for the whole reservation, and
+ * mprotect() splits inherit them. */
+struct arena {
+    char *data;
+    size_t size;
+    size_t max_size;
+    size_t used; /* high-water mark: nothing past it needs wiping */
+};
+
+static void arena_touch(struct arena *a, size_t end)
+{
+    if (end > a->used)
+        a->used = end < a->size ? end : a->size;
+}
+
+/* Wipe what has been written; the arena stays usable. */
+static void arena_wipe(struct arena *a)
+{
+    if (a->data == NULL)
+        return;
+    paskuda_wipe(a->data, a->used);
+    a->used = 0;
+}
+
+static int arena_commit(char *p, size_t size)
+{
+    if (mprotect(p, size, PROT_READ | PROT_WRITE) < 0)
+        return -1;
+    if (mlock(p, size) < 0) {
+        const int orig_errno = errno;
+        mprotect(p, size, PROT_NONE);
+        errno = orig_errno;
+        return -1;
+    }
+    return 0;
+}
+
+static int arena_init(struct arena *a, size_t max_size)
+{
+    if (max_size > SIZE_MAX / 2)
+        max_size = SIZE_MAX / 2;
+    a->max_size = (max_size + page_size - 1) / page_size * page_size;
+    if (a->max_size < (size_t)page_size)
+        a->max_size = page_size;
+    const size_t total = a->max_size + 2 * page_size;
+    char *base = mmap(NULL, total, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return -1;
+    int rc = 0;
+#ifdef MADV_DONTDUMP
+    if (rc == 0)
+        rc = madvise(base, total, MADV_DONTDUMP);
+#endif
+#ifdef MADV_WIPEONFORK
+    if (rc == 0 && madvise(base, total, MADV_WIPEONFORK) < 0 && errno != EINVAL) /* EINVAL: Linux < 4.14 */
+        rc = -1;
+#endif
+    if (rc == 0)
+        rc = arena_commit(base + page_size, page_size);
+    if (rc < 0) {
+        const int orig_errno = errno;
+        munmap(base, total);
+        errno = orig_errno;
+        return -1;
+    }
+    a->data = base + page_size;
+    a->size = page_size;
+    a->used = 0;
+    return 0;
+}
+
+/* Double the accessible size; return 0 and set errno if that's not possible. */
+static int arena_grow(struct arena *a)
+{
+    if (a->size >= a->max_size) {
+        errno = EMSGSIZE;
+        return 0;
+    }
+    size_t size = a->size * 2;
+    if (size > a->max_size)
+        size = a->max_size;
+    if (arena_commit(a->data + a->size, size - a->size) < 0)
+        return 0;
+    a->size = size;
+    return 1;
+}
+
+static int arena_reserve(struct arena *a, size_t size)
+{
+    while (a->size < size)
+        if (!arena_grow(a))
+            return -1;
+    return 0;
+}
+
+static void arena_free(struct arena *a)
+{
+    if (a->data == NULL)
+        return;
+    arena_wipe(a);
+    munmap(a->data - page_size, a->max_size + 2 * page_size);
+    a->data = NULL;
+    a->size = 0;
+}
+
+struct secret {
+    struct paskuda_secret pub; /* must be first */
+    struct arena arena;
+    struct secret *prev, *next;
+};
+
+/* the secrets not freed yet, for wipe_all() */
+static struct secret *secrets;
+
+static int tty_fd = -1;
+static struct termios orig_tio;
+
+/* Unless asked to keep typeahead, discard input typed before the prompt
+ * (the terminal may have echoed it) and after the secret. */
+static int keep_typeahead = 0;
+
+/* Input that followed the newline in the last chunk read; it is kept for
+ * the next secret, since it cannot be pushed back, and lost at paskuda_end(). */
+static struct {
+    struct arena arena;
+    size_t off;
+    size_t len;
+} pending;
+
+static int stash_pending(const char *s, size_t n, size_t max_size)
+{
+    assert(pending.len == 0);
+    if (pending.arena.data && pending.arena.max_size < n)
+        arena_free(&pending.arena);
+    if (pending.arena.data == NULL && arena_init(&pending.arena, max_size) < 0)
+        return -1;
+    if (arena_reserve(&pending.arena, n) < 0)
+        return -1;
+    memcpy(pending.arena.data, s, n);
+    arena_touch(&pending.arena, n);
+    pending.off = 0;
+    pending.len = n;
+    return 0;
+}
+
+static void consume_pending(size_t n)
+{
+    paskuda_wipe(pending.arena.data + pending.off, n);
+    pending.off += n;
+    pending.len -= n;
+}
+
+static void drop_pending()
+{
+    if (pending.len > 0)
+        consume_pending(pending.len);
+}
+
+static void release_signals();
+
+static int restore_tty()
+{
+    release_signals();
+    if (tty_fd < 0)
+        return 0;
+    if (!keep_typeahead)
+        drop_pending();
+    int rc = tcsetattr(tty_fd, keep_typeahead ? TCSADRAIN : TCSAFLUSH, &orig_tio);
+    tty_fd = -1;
+    return rc;
+}
+
+static void wipe_all();
+
+static void restore_tty_at_exit()
+{
+    restore_tty();
+    wipe_all();
+}
+
+static int init_tty(int fd)
+{
+    struct termios tio;
+    if (tcgetattr(fd, &tio) < 0)
+        return -1;
+    orig_tio = tio;
+    tio.c_lflag &= ~(ECHO | ICANON);
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    if (tcsetattr(fd, keep_typeahead ? TCSANOW : TCSAFLUSH, &tio) < 0)
+        return -1;
+    tty_fd = fd;
+    return 0;
+}
+
+/* Terminal output queue (a ring buffer).
+ *
+ * In lossy mode, which is used while echoing to a non-blocking descriptor,
+ * it is drained only as far as the terminal accepts without blocking, and
+ * output that does not fit is dropped; the overflow flag then tells the
+ * terminal sink to redraw the line once the queue has drained.
+ *
+ * A write error discards the queue and is remembered, to be reported once
+ * the secret has been read. */
+static struct {
+    char data[4096];
+    size_t head;
+    size_t len;
+    int lossy;
+    int overflow;
+    int error;
+    size_t used; /* high-water mark, as in struct arena */
+} out_buf;
+
+static void out_discard()
+{
+    paskuda_wipe(out_buf.data, out_buf.used);
+    out_buf.used = 0;
+    out_buf.head = out_buf.len = 0;
+    out_buf.overflow = 0;
+}
+
+/* Write as much of the queue as fd accepts; return whether it is empty. */
+static int out_drain(int fd)
+{
+    while (out_buf.len > 0) {
+        size_t m = sizeof out_buf.data - out_buf.head;
+        if (m > out_buf.len)
+            m = out_buf.len;
+        const int64_t t0 = stats ? monotonic_us() : 0;
+        ssize_t n = write(fd, out_buf.data + out_buf.head, m);
+        if (stats) {
+            stats->writes++;
+            stats->write_us += monotonic_us() - t0;
+            if (n > 0)
+                stats->echo_bytes += n;
+        }
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            out_buf.error = errno;
+            out_discard();
+            break;
+        }
+        out_buf.head = (out_buf.head + n) % sizeof out_buf.data;
+        out_buf.len -= n;
+    }
+    out_buf.head = 0;
+    return 1;
+}
+
+static void out_flush(int fd)
+{
+    while (!out_drain(fd)) {
+        struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+        const int64_t t0 = stats ? monotonic_us() : 0;
+        const int rc = poll(&pfd, 1, -1);
+        if (stats)
+            stats->write_us += monotonic_us() - t0;
+        if (rc < 0 && errno != EINTR) {
+            out_buf.error = errno;
+            out_discard();
+        }
+    }
+}
+
+/* Append n bytes, copied from s or, if s is NULL, all equal to c. */
+static void out_add(int fd, const char *s, char c, size_t n)
+{
+    if (out_buf.lossy) {
+        if (out_buf.overflow)
+            return;
+        if (n > sizeof out_buf.data - out_buf.len)
+            out_drain(fd);
+        if (n > sizeof out_buf.data - out_buf.len) {
+            /* Don't queue a part of it: it might be a truncated
+             * escape sequence. */
+            out_buf.overflow = 1;
+            return;
+        }
+    }
+    while (n > 0) {
+        if (out_buf.len == sizeof out_buf.data)
+            out_flush(fd);
+        const size_t tail = (out_buf.head + out_buf.len) % sizeof out_buf.data;
+        size_t m;
+        if (tail < out_buf.head)
+            m = out_buf.head - tail;
+        else
+            m = sizeof out_buf.data - tail;
+        if (m > n)
+            m = n;
+        if (s) {
+            memcpy(out_buf.data + tail, s, m);
+            s += m;
+        } else
+            memset(out_buf.data + tail, c, m);
+        out_buf.len += m;
+        if (tail + m > out_buf.used)
+            out_buf.used = tail + m;
+        n -= m;
+    }
+}
+
+static void out_put(int fd, const char *s, size_t n)
+{
+    out_add(fd, s, '\0', n);
+}
+
+static void out_fill(int fd, char c, size_t n)
+{
+    out_add(fd, NULL, c, n);
+}
+
+static void out_puts(int fd, const char *s)
+{
+    out_put(fd, s, strlen(s));
+}
+
+/* Queue the strings; if the queue is empty, they are first written out
+ * directly, with a single writev(), and only the rest is queued. */
+static void out_putv(int fd, const struct iovec *iov, int iovcnt)
+{
+    size_t done = 0;
+    if (out_buf.len == 0 && !out_buf.overflow) {
+        const int64_t t0 = stats ? monotonic_us() : 0;
+        ssize_t n;
+        do
+            n = writev(fd, iov, iovcnt);
+        while (n < 0 && errno == EINTR);
+        if (stats) {
+            stats->writes++;
+            stats->write_us += monotonic_us() - t0;
+            if (n > 0)
+                stats->echo_bytes += n;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            out_buf.error = errno;
+            return;
+        }
+        if (n > 0)
+            done = n;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        const size_t len = iov[i].iov_len;
+        if (done >= len) {
+            done -= len;
+            continue;
+        }
+        out_put(fd, (const char *)iov[i].iov_base + done, len - done);
+        done = 0;
+    }
+}
+
+static int ansi = 0;
+
+static int term_is_ansi()
+{
+    static const char *prefixes[] = {
+        "xterm", "screen", "tmux", "rxvt", "linux", "vt100", "vt102", "vt220",
+        "konsole", "gnome", "alacritty", "foot", "kitty", "putty", "st-",
+        NULL
+    };
+    const char *term = getenv("TERM");
+    if (term == NULL)
+        return 0;
+    for (const char **p = prefixes; *p; p++)
+        if (strncmp(term, *p, strlen(*p)) == 0)
+            return 1;
+    return 0;
+}
+
+static void clear_n(int fd, size_t n)
+{
+    if (ansi && n > 2) {
+        /* CSI n D (cursor backward) + CSI K (erase to end of line) */
+        char seq[32] = "\033[";
+        size_t len = 2 + format_size(seq + 2, n);
+        memcpy(seq + len, "D\033[K", 4);
+        out_put(fd, seq, len + 4);
+        return;
+    }
+    while (n-- > 0)
+        out_put(fd, "\b \b", 3);
+}
+
+/* Decode the UTF-8 sequence at s; return its length. An invalid or
+ * truncated sequence is taken as a single byte, decoded as U+FFFD. */
+static size_t utf8_decode(const char *s, size_t n, uint32_t *cp)
+{
+    const unsigned char *u = (const unsigned char *)s;
+    *cp = u[0];
+    if (u[0] < 0x80)
+        return 1;
+    size_t len;
+    uint32_t min;
+    if ((u[0] & 0xE0) == 0xC0) {
+        len = 2;
+        min = 0x80;
+        *cp = u[0] & 0x1F;
+    } else if ((u[0] & 0xF0) == 0xE0) {
+        len = 3;
+        min = 0x800;
+        *cp = u[0] & 0x0F;
+    } else if ((u[0] & 0xF8) == 0xF0) {
+        len = 4;
+        min = 0x10000;
+        *cp = u[0] & 0x07;
+    } else
+        goto invalid;
+    if (len > n)
+        goto invalid;
+    for (size_t i = 1; i < len; i++) {
+        if ((u[i] & 0xC0) != 0x80)
+            goto invalid;
+        *cp = *cp << 6 | (u[i] & 0x3F);
+    }
+    if (*cp < min || *cp > 0x10FFFF || (*cp >= 0xD800 && *cp <= 0xDFFF))
+        goto invalid;
+    return len;
+invalid:
+    *cp = 0xFFFD;
+    return 1;
+}
+
+/* Columns taken by the character on the terminal; a rough wcwidth() that
+ * does not depend on the locale. */
+static size_t cp_width(uint32_t cp)
+{
+    static const uint32_t zero[][2] = {
+        { 0x0300, 0x036F }, { 0x200B, 0x200F }, { 0xFE00, 0xFE0F }, { 0xFE20, 0xFE2F },
+    };
+    static const uint32_t wide[][2] = {
+        { 0x1100, 0x115F }, { 0x2E80, 0x303E }, { 0x3041, 0x33FF }, { 0x3400, 0x4DBF },
+        { 0x4E00, 0x9FFF }, { 0xA000, 0xA4CF }, { 0xAC00, 0xD7A3 }, { 0xF900, 0xFAFF },
+        { 0xFE30, 0xFE4F }, { 0xFF00, 0xFF60 }, { 0xFFE0, 0xFFE6 }, { 0x1F300, 0x1F64F },
+        { 0x1F900, 0x1F9FF }, { 0x20000, 0x3FFFD },
+    };
+    for (size_t i = 0; i < sizeof zero / sizeof *zero; i++)
+        if (cp >= zero[i][0] && cp <= zero[i][1])
+            return 0;
+    for (size_t i = 0; i < sizeof wide / sizeof *wide; i++)
+        if (cp >= wide[i][0] && cp <= wide[i][1])
+            return 2;
+    return 1;
+}
+
+static size_t utf8_width(const char *s, size_t n)
+{
+    size_t width = 0;
+    while (n > 0) {
+        uint32_t cp;
+        const size_t len = utf8_decode(s, n, &cp);
+        width += cp_width(cp);
+        s += len;
+        n -= len;
+    }
+    return width;
+}
+
+/* Whether the n bytes at s are the beginning of a sequence that is still
+ * to be completed. */
+static int utf8_incomplete(const char *s, size_t n)
+{
+    const unsigned char *u = (const unsigned char *)s;
+    const size_t len =
+        (u[0] & 0xE0) == 0xC0 ? 2 :
+        (u[0] & 0xF0) == 0xE0 ? 3 :
+        (u[0] & 0xF8) == 0xF0 ? 4 : 1;
+    if (n >= len)
+        return 0;
+    for (size_t i = 1; i < n; i++)
+        if ((u[i] & 0xC0) != 0x80)
+            return 0;
+    return 1;
+}
+
+/* A message shown after the prompt; its length and width are worked out
+ * once, in setup(). */
+struct msg {
+    const char *s;
+    size_t len;
+    size_t width; /* in terminal columns */
+};
+
+static struct msg msg_press_tab = { .s = "(press TAB for no echo) " };
+static struct msg msg_no_echo = { .s = "(no echo) " };
+
+static void msg_init(struct msg *msg)
+{
+    msg->len = strlen(msg->s);
+    msg->width = utf8_width(msg->s, msg->len);
+}
+
+enum state {
+    STATE_INIT,
+    STATE_ECHO,
+    STATE_NO_ECHO,
+};
+
+/* What the editor asks the terminal to show; n is a number of characters,
+ * and, for ECHO_INSERT and ECHO_ERASE, bytes is their length in bytes. */
+enum echo_action {
+    ECHO_INSERT,
+    ECHO_ERASE,
+    ECHO_CLEAR_HINT,
+    ECHO_NO_ECHO,
+    ECHO_PASTE,
+    ECHO_BELL,
+};
+
+struct echo_sink {
+    void (*echo)(struct echo_sink *sink, enum echo_action action, size_t n, size_t bytes);
+};
+
+/* Line editor for the secret. It does no I/O of its own: input is fed in
+ * chunks, and the visible effects are reported to the sink. */
+struct editor {
+    enum state state;
+    int visible; /* echo as typed rather than as asterisks */
+    char *buf;
+    size_t size;
+    size_t len;
+    /* UTF-8 character boundaries, so that a character can be erased as a
+     * whole: a bitmap of the bytes of buf that begin one */
+    unsigned char *starts;
+    size_t chars; /* characters in buf */
+    unsigned int cont; /* continuation bytes still expected */
+    int pasting; /* a paste summary is shown in place of the input */
+    size_t pasted; /* characters inserted since then */
+    int eol;
+};
+
+static int is_special(char c)
+{
+    switch (c) {
+    case '\b':
+    case '\t':
+    case '\n':
+    case 0x15: // ^U
+    case 0x7F: // DEL
+        return 1;
+    }
+    return 0;
+}
+
+#define SWAR_ONES UINT64_C(0x0101010101010101)
+#define SWAR_HAS_ZERO(v) (((v) - SWAR_ONES) & ~(v) & (SWAR_ONES * 0x80))
+#define SWAR_HAS_BYTE(v, c) SWAR_HAS_ZERO((v) ^ (SWAR_ONES * (c)))
+
+/* Return the length of the initial run of bytes that need no special handling. */
+static size_t scan_plain(const char *s, size_t n)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i bs = _mm_set1_epi8('\b');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i nak = _mm_set1_epi8(0x15);
+    const __m128i del = _mm_set1_epi8(0x7F);
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, bs), _mm_cmpeq_epi8(v, tab)),
+                _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, nak))
+            ),
+            _mm_cmpeq_epi8(v, del)
+        );
+        int mask = _mm_movemask_epi8(m);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#else
+    for (; i + 8 <= n; i += 8) {
+        uint64_t v;
+        memcpy(&v, s + i, sizeof v);
+        uint64_t m =
+            SWAR_HAS_BYTE(v, '\b') | SWAR_HAS_BYTE(v, '\t') | SWAR_HAS_BYTE(v, '\n') |
+            SWAR_HAS_BYTE(v, 0x15) | SWAR_HAS_BYTE(v, 0x7F);
+        if (m)
+            break;
+    }
+#endif
+    while (i < n && !is_special(s[i]))
+        i++;
+    return i;
+}
+
+static void editor_init(struct editor *ed, char *buf, size_t size, unsigned char *starts, int visible)
+{
+    ed->state = visible ? STATE_ECHO : STATE_INIT;
+    ed->visible = visible;
+    ed->buf = buf;
+    ed->size = size;
+    ed->len = 0;
+    ed->starts = starts;
+    ed->chars = 0;
+    ed->cont = 0;
+    ed->pasting = 0;
+    ed->pasted = 0;
+    ed->eol = 0;
+}
+
+/* Account for the byte stored at ed->buf[i]; return 1 if it begins a
+ * character. Malformed input is taken a byte at a time. */
+static size_t editor_mark(struct editor *ed, size_t i)
+{
+    const unsigned char c = ed->buf[i];
+    const unsigned char bit = 1 << (i % 8);
+    if (ed->cont > 0 && (c & 0xC0) == 0x80) {
+        ed->cont--;
+        ed->starts[i / 8] &= ~bit;
+        return 0;
+    }
+    ed->cont = c >= 0xF8 ? 0 : c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+    ed->starts[i / 8] |= bit;
+    ed->chars++;
+    return 1;
+}
+
+/* Drop the last character; return the new length. No character is longer
+ * than 4 bytes, so this takes constant time. */
+static size_t editor_pop(struct editor *ed, size_t len)
+{
+    do
+        len--;
+    while (len > 0 && !(ed->starts[len / 8] >> (len % 8) & 1));
+    ed->chars--;
+    ed->cont = 0;
+    return len;
+}
+
+static void editor_clear(struct editor *ed)
+{
+    ed->chars = 0;
+    ed->cont = 0;
+}
+
+/* Nobody types this many characters between two reads. */
+#define PASTE_THRESHOLD 16
+
+/* Process up to n bytes of input, stopping after a newline (ed->eol is then
+ * set); return the number of bytes consumed.
+ *
+ * The input may be read in place, i.e. s may point at ed->buf + ed->len:
+ * bytes are only ever moved backwards, so s[i] is consumed before
+ * ed->buf[ed->len] can overwrite it. */
+static size_t editor_feed(struct editor *ed, const char *s, size_t n, struct echo_sink *sink)
+{
+    size_t len = ed->len;
+    const int paste = n >= PASTE_THRESHOLD && ed->state != STATE_NO_ECHO && !ed->visible;
+    if (paste) {
+        /* Echo a summary of the pasted text rather than a line of asterisks;
+         * the rest of the input is not echoed either. */
+        if (ed->state == STATE_INIT)
+            sink->echo(sink, ECHO_CLEAR_HINT, 0, 0);
+        else
+            sink->echo(sink, ECHO_ERASE, ed->chars, len);
+        ed->state = STATE_NO_ECHO;
+        ed->pasting = 1;
+        ed->pasted = 0;
+    }
+    size_t inserted = 0;
+    size_t i = 0;
+    while (i < n) {
+        if (ed->state != STATE_INIT) {
+            /* fast path for pasted text: copy the whole plain run at once */
+            const size_t run = scan_plain(s + i, n - i);
+            if (run > 0) {
+                const size_t room = ed->size - 1 - len;
+                const size_t m = run < room ? run : room;
+                if (ed->buf + len != s + i)
+                    memmove(ed->buf + len, s + i, m);
+                size_t started = 0;
+                for (size_t j = len; j < len + m; j++)
+                    started += editor_mark(ed, j);
+                len += m;
+                inserted += started;
+                if (m > 0 && ed->state == STATE_ECHO)
+                    sink->echo(sink, ECHO_INSERT, started, m);
+                if (run > m)
+                    sink->echo(sink, ECHO_BELL, run - m, 0);
+                i += run;
+                continue;
+            }
+        }
+        register char c = s[i++];
+        if (c == '\n') {
+            ed->eol = 1;
+            break;
+        }
+        if (ed->state == STATE_INIT) {
+            sink->echo(sink, ECHO_CLEAR_HINT, 0, 0);
+            if (c == '\b' || c == 0x7F /* DEL */) {
+                sink->echo(sink, ECHO_NO_ECHO, 0, 0);
+                ed->state = STATE_NO_ECHO;
+                continue;
+            }
+            else
+                ed->state = STATE_ECHO;
+        }
+        switch (c)
+        {
+        case '\b':
+        case 0x7F: // DEL
+            if (len) {
+                const size_t old_len = len;
+                len = editor_pop(ed, len);
+                if (ed->state == STATE_ECHO)
+                    sink->echo(sink, ECHO_ERASE, 1, old_len - len);
+            } else
+                sink->echo(sink, ECHO_BELL, 1, 0);
+            break;
+        case 0x15: // ^U
+            if (ed->state == STATE_ECHO)
+                sink->echo(sink, ECHO_ERASE, ed->chars, len);
+            len = 0;
+            editor_clear(ed);
+            break;
+        case '\t':
+            if (ed->state == STATE_ECHO) {
+                sink->echo(sink, ECHO_ERASE, ed->chars, len);
+                sink->echo(sink, ECHO_NO_ECHO, 0, 0);
+            }
+            ed->state = STATE_NO_ECHO;
+            break;
+        default:
+            if (len < ed->size - 1) {
+                ed->buf[len] = c;
+                const size_t started = editor_mark(ed, len);
+                len++;
+                inserted += started;
+                if (ed->state == STATE_ECHO)
+                    sink->echo(sink, ECHO_INSERT, started, 1);
+            } else
+                sink->echo(sink, ECHO_BELL, 1, 0);
+        }
+    }
+    /* a large paste may come in several chunks; count them all */
+    if (paste || (ed->pasting && inserted > 0)) {
+        ed->pasted += inserted;
+        sink->echo(sink, ECHO_PASTE, ed->pasted, 0);
+    }
+    ed->len = len;
+    return i;
+}
+
+/* Take the asterisks off the screen; visible input is left as is. */
+static void editor_finish(struct editor *ed, struct echo_sink *sink)
+{
+    if (ed->state == STATE_INIT)
+        sink->echo(sink, ECHO_CLEAR_HINT, 0, 0);
+    if (ed->state == STATE_ECHO && !ed->visible)
+        sink->echo(sink, ECHO_ERASE, ed->chars, ed->len);
+}
+
+/* Limits on waiting for input, in milliseconds (0 means no limit): for the
+ * whole secret, and since the last keystroke. */
+static struct {
+    int64_t total;
+    int64_t idle;
+    int64_t deadline;
+    int64_t idle_deadline;
+} input_timeout;
+
+static void start_timeout()
+{
+    const int64_t now = monotonic_ms();
+    input_timeout.deadline = now + input_timeout.total;
+    input_timeout.idle_deadline = now + input_timeout.idle;
+}
+
+struct tty_sink {
+    struct echo_sink sink;
+    int fd;
+    /* the prompt, a space, and the hint, as first written */
+    struct iovec frame[3];
+    int frame_len;
+    /* what is on the line after the prompt, for redrawing it */
+    enum {
+        SHOWN_HINT,
+        SHOWN_STARS,
+        SHOWN_NO_ECHO,
+        SHOWN_PASTE,
+    } shown;
+    const char *text; /* the input, if echoed as typed */
+    size_t n; /* characters echoed, or pasted */
+    size_t bytes; /* bytes of text echoed */
+    /* the width of text, up to the last character that may be incomplete */
+    size_t measured;
+    size_t measured_width;
+    size_t width; /* widest it has been */
+};
+
+static struct tty_sink tty_sink;
+
+/* Width of the text echoed; only what was added since the last call is
+ * scanned. */
+static size_t tty_text_width(struct tty_sink *tty)
+{
+    while (tty->measured < tty->bytes) {
+        const char *s = tty->text + tty->measured;
+        const size_t n = tty->bytes - tty->measured;
+        if (utf8_incomplete(s, n))
+            return tty->measured_width + utf8_width(s, n);
+        uint32_t cp;
+        tty->measured += utf8_decode(s, n, &cp);
+        tty->measured_width += cp_width(cp);
+    }
+    return tty->measured_width;
+}
+
+static void tty_sync();
+
+/* read() from stdin, but give up when a deadline passes;
+ * meanwhile, keep draining the terminal output queue. */
+static ssize_t read_input(char *buf, size_t n)
+{
+    while (1) {
+        int64_t deadline = INT64_MAX;
+        if (input_timeout.total)
+            deadline = input_timeout.deadline;
+        if (input_timeout.idle && input_timeout.idle_deadline < deadline)
+            deadline = input_timeout.idle_deadline;
+        const int output = out_buf.lossy && (out_buf.len > 0 || out_buf.overflow);
+        if (deadline == INT64_MAX && !output)
+            break;
+        int timeout = -1;
+        if (deadline < INT64_MAX) {
+            const int64_t now = monotonic_ms();
+            if (now >= deadline) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            timeout = deadline - now > INT_MAX ? INT_MAX : (int)(deadline - now);
+        }
+        struct pollfd pfd[] = {
+            { .fd = STDIN_FILENO, .events = POLLIN },
+            { .fd = tty_sink.fd, .events = POLLOUT },
+        };
+        const int64_t t0 = stats ? monotonic_us() : 0;
+        int rc = poll(pfd, output ? 2 : 1, timeout);
+        if (stats)
+            stats->read_us += monotonic_us() - t0;
+        if (rc < 0 && errno != EINTR)
+            return -1;
+        if (rc <= 0)
+            continue;
+        if (output && pfd[1].revents)
+            tty_sync();
+        if (pfd[0].revents)
+            break;
+    }
+    const int64_t t0 = stats ? monotonic_us() : 0;
+    ssize_t rc = read(STDIN_FILENO, buf, n);
+    if (stats) {
+        stats->reads++;
+        stats->read_us += monotonic_us() - t0;
+        if (rc > 0) {
+            stats->read_bytes += rc;
+            if ((size_t)rc > stats->max_read_bytes)
+                stats->max_read_bytes = rc;
+            stats_input();
+        }
+    }
+    if (rc > 0 && input_timeout.idle)
+        input_timeout.idle_deadline = monotonic_ms() + input_timeout.idle;
+    return rc;
+}
+
+static size_t format_paste_msg(char *buf, size_t n)
+{
+    static const char suffix[] = " chars pasted] ";
+    buf[0] = '[';
+    const size_t len = 1 + format_size(buf + 1, n);
+    memcpy(buf + len, suffix, sizeof suffix - 1);
+    return len + sizeof suffix - 1;
+}
+
+/* Put what should be on the line after the prompt into the queue. */
+static size_t tty_put_shown(struct tty_sink *tty)
+{
+    const int fd = tty->fd;
+    char msg[64];
+    size_t len;
+    switch (tty->shown) {
+    case SHOWN_HINT:
+        out_put(fd, msg_press_tab.s, msg_press_tab.len);
+        return msg_press_tab.width;
+    case SHOWN_STARS:
+        if (tty->text) {
+            out_put(fd, tty->text, tty->bytes);
+            return tty_text_width(tty);
+        }
+        out_fill(fd, '*', tty->n);
+        return tty->n;
+    case SHOWN_NO_ECHO:
+        out_put(fd, msg_no_echo.s, msg_no_echo.len);
+        return msg_no_echo.width;
+    case SHOWN_PASTE:
+        len = format_paste_msg(msg, tty->n);
+        out_put(fd, msg, len);
+        return len;
+    }
+    return 0;
+}
+
+static void tty_echo(struct echo_sink *sink, enum echo_action action, size_t n, size_t bytes)
+{
+    struct tty_sink *tty = (struct tty_sink *)sink;
+    const int fd = tty->fd;
+    size_t width = 0;
+    switch (action) {
+    case ECHO_INSERT:
+        if (tty->text)
+            out_put(fd, tty->text + tty->bytes, bytes);
+        else
+            out_fill(fd, '*', n);
+        tty->n += n;
+        tty->bytes += bytes;
+        width = tty->text ? tty_text_width(tty) : tty->n;
+        break;
+    case ECHO_ERASE:
+        tty->n -= n;
+        tty->bytes -= bytes;
+        clear_n(fd, tty->text ? utf8_width(tty->text + tty->bytes, bytes) : n);
+        if (tty->measured > tty->bytes) {
+            tty->measured_width -= utf8_width(tty->text + tty->bytes, tty->measured - tty->bytes);
+            tty->measured = tty->bytes;
+        }
+        break;
+    case ECHO_CLEAR_HINT:
+        clear_n(fd, msg_press_tab.width);
+        tty->shown = SHOWN_STARS;
+        tty->n = 0;
+        tty->bytes = 0;
+        tty->measured = 0;
+        tty->measured_width = 0;
+        break;
+    case ECHO_PASTE:
+        if (tty->shown == SHOWN_PASTE) {
+            /* update the count */
+            char msg[64];
+            clear_n(fd, format_paste_msg(msg, tty->n));
+        }
+        /* fall through */
+    case ECHO_NO_ECHO:
+        tty->shown = action == ECHO_NO_ECHO ? SHOWN_NO_ECHO : SHOWN_PASTE;
+        tty->n = n;
+        width = tty_put_shown(tty);
+        break;
+    case ECHO_BELL:
+        out_fill(fd, '\a', n);
+        break;
+    }
+    if (width > tty->width)
+        tty->width = width;
+}
+
+/* Rewrite the whole line from scratch, whatever is on it now. */
+static void tty_redraw()
+{
+    const int fd = tty_sink.fd;
+    const int lossy = out_buf.lossy;
+    out_buf.lossy = 0;
+    out_puts(fd, "\r");
+    out_putv(fd, tty_sink.frame, 2);
+    const size_t width = tty_put_shown(&tty_sink);
+    if (ansi)
+        out_puts(fd, "\033[K");
+    else if (tty_sink.width > width) {
+        out_fill(fd, ' ', tty_sink.width - width);
+        out_fill(fd, '\b', tty_sink.width - width);
+    }
+    out_buf.lossy = lossy;
+}
+
+/* Drain the output queue; once it is empty after an overflow, redraw. */
+static void tty_sync()
+{
+    if (out_drain(tty_sink.fd) && out_buf.overflow) {
+        out_buf.overflow = 0;
+        tty_redraw();
+        out_drain(tty_sink.fd);
+    }
+}
+
+/* Open a non-blocking descriptor for echo, so that a stalled terminal
+ * doesn't hold up input processing. The terminal is reopened rather than
+ * O_NONBLOCK set on stderr, because the file status flags would be shared
+ * with other processes. Return -1 if that's not possible. */
+static int open_echo_fd()
+{
+    if (!isatty(STDERR_FILENO))
+        return -1;
+    const char *path = ttyname(STDERR_FILENO);
+    if (path == NULL)
+        return -1;
+    return open(path, O_WRONLY | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+}
+
+static int echo_fd = -1;
+static int echo_nonblock = 0;
+
+/* the editor's character start bitmap; it is wiped after each secret */
+static struct arena starts;
+
+static int reserve_starts(size_t size, size_t max_size)
+{
+    if (starts.data && starts.max_size < max_size / 8 + 1)
+        arena_free(&starts);
+    if (starts.data == NULL && arena_init(&starts, max_size / 8 + 1) < 0)
+        return -1;
+    if (arena_reserve(&starts, size / 8 + 1) < 0)
+        return -1;
+    arena_touch(&starts, size / 8 + 1);
+    return 0;
+}
+
+/* Wipe all locked memory: the secrets, and whatever they passed through. */
+static void wipe_all()
+{
+    for (struct secret *s = secrets; s; s = s->next)
+        arena_wipe(&s->arena);
+    arena_wipe(&pending.arena);
+    pending.len = 0;
+    arena_wipe(&starts);
+    out_discard();
+}
+
+/* While a secret is being read, a fatal signal restores the terminal and
+ * wipes everything before it is let through. */
+static const int fatal_signals[] = { SIGHUP, SIGINT, SIGQUIT, SIGTERM };
+#define N_FATAL_SIGNALS (sizeof fatal_signals / sizeof *fatal_signals)
+static struct sigaction orig_actions[N_FATAL_SIGNALS];
+static int caught[N_FATAL_SIGNALS];
+
+static void on_fatal_signal(int sig)
+{
+    const int orig_errno = errno;
+    if (tty_fd >= 0)
+        tcsetattr(tty_fd, TCSANOW, &orig_tio);
+    wipe_all();
+    for (size_t i = 0; i < N_FATAL_SIGNALS; i++)
+        if (fatal_signals[i] == sig && caught[i]) {
+            sigaction(sig, &orig_actions[i], NULL);
+            caught[i] = 0;
+        }
+    /* delivered once the handler returns */
+    raise(sig);
+    errno = orig_errno;
+}
+
+static void catch_signals()
+{
+    struct sigaction sa = { .sa_handler = on_fatal_signal };
+    sigemptyset(&sa.sa_mask);
+    for (size_t i = 0; i < N_FATAL_SIGNALS; i++) {
+        if (caught[i])
+            continue;
+        if (sigaction(fatal_signals[i], NULL, &orig_actions[i]) < 0)
+            continue;
+        /* ignored signals stay ignored, and other handlers are left alone */
+        if (orig_actions[i].sa_handler != SIG_DFL)
+            continue;
+        if (sigaction(fatal_signals[i], &sa, NULL) == 0)
+            caught[i] = 1;
+    }
+}
+
+static void release_signals()
+{
+    for (size_t i = 0; i < N_FATAL_SIGNALS; i++)
+        if (caught[i]) {
+            sigaction(fatal_signals[i], &orig_actions[i], NULL);
+            caught[i] = 0;
+        }
+}
+
+/* Read a secret into the arena, starting at base; return its length. */
+static ssize_t read_tty(const char *prompt, int visible, struct arena *a, size_t base)
+{
+    const int fd = echo_fd;
+    tty_sink = (struct tty_sink) {
+        .sink.echo = tty_echo,
+        .fd = fd,
+        .frame = {
+            { .iov_base = (void *)prompt, .iov_len = strlen(prompt) },
+            { .iov_base = " ", .iov_len = 1 },
+            { .iov_base = (void *)msg_press_tab.s, .iov_len = msg_press_tab.len },
+        },
+        .frame_len = visible ? 2 : 3,
+        .shown = visible ? SHOWN_STARS : SHOWN_HINT,
+        .text = visible ? a->data + base : NULL,
+        .width = visible ? 0 : msg_press_tab.width,
+    };
+    if (reserve_starts(a->size - base, a->max_size) < 0)
+        return -1;
+    struct editor ed;
+    editor_init(&ed, a->data + base, a->size - base, (unsigned char *)starts.data, visible);
+    out_putv(fd, tty_sink.frame, tty_sink.frame_len);
+    out_flush(fd);
+    out_buf.lossy = echo_nonblock;
+    while (!ed.eol) {
+        assert(base + ed.len < a->size);
+        if (pending.len > 0) {
+            while (base + ed.len + pending.len >= a->size && arena_grow(a))
+                ;
+            ed.size = a->size - base;
+            if (reserve_starts(ed.size, a->max_size) < 0)
+                return -1;
+            /* each byte fed appends at most one */
+            arena_touch(a, base + ed.len + pending.len);
+            stats_input();
+            const size_t used = editor_feed(&ed, pending.arena.data + pending.off, pending.len, &tty_sink.sink);
+            consume_pending(used);
+        } else {
+            if (base + ed.len == a->size - 1 && arena_grow(a)) {
+                ed.size = a->size - base;
+                if (reserve_starts(ed.size, a->max_size) < 0)
+                    return -1;
+            }
+            size_t avail = ed.size - 1 - ed.len;
+            if (keep_typeahead || avail == 0) {
+                /* a byte at a time, so that input after the newline
+                 * stays in the terminal's queue for whoever reads next */
+                avail = 1;
+            }
+            ssize_t n = read_input(a->data + base + ed.len, avail);
+            if (n < 0)
+                return -1;
+            if (n == 0)
+                break;
+            /* the chunk is read in place */
+            const size_t off = base + ed.len;
+            arena_touch(a, off + n);
+            const size_t used = editor_feed(&ed, a->data + off, n, &tty_sink.sink);
+            if (used < (size_t)n) {
+                if (stash_pending(a->data + off + used, n - used, a->max_size) < 0)
+                    return -1;
+                paskuda_wipe(a->data + off + used, n - used);
+            }
+        }
+        if (echo_nonblock)
+            tty_sync();
+        else
+            out_flush(fd);
+    }
+    editor_finish(&ed, &tty_sink.sink);
+    out_buf.lossy = 0;
+    out_flush(fd);
+    if (out_buf.overflow) {
+        out_buf.overflow = 0;
+        tty_redraw();
+    }
+    out_puts(fd, "\n");
+    out_flush(fd);
+    if (out_buf.error) {
+        errno = out_buf.error;
+        out_buf.error = 0;
+        return -1;
+    }
+    return ed.len;
+}
+
+/* Read a line into the arena, starting at base; return its length.
+ * Set *eof if there was nothing left to read. */
+static ssize_t read_stream(struct arena *a, size_t base, int *eof)
+{
+    size_t len = base;
+    if (pending.len > 0) {
+        const char *s = pending.arena.data + pending.off;
+        const char *eol = memchr(s, '\n', pending.len);
+        const size_t n = eol ? (size_t)(eol - s) : pending.len;
+        stats_input();
+        if (arena_reserve(a, base + n + 1) < 0)
+            return -1;
+        memcpy(a->data + base, s, n);
+        arena_touch(a, base + n);
+        consume_pending(eol ? n + 1 : n);
+        if (eol)
+            return n;
+        len += n;
+    }
+    while (1) {
+        if (len == a->size && !arena_grow(a))
+            return -1;
+        ssize_t n = read_input(a->data + len, a->size - len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0) {
+            *eof = (len == base);
+            return len - base;
+        }
+        char *eol = memchr(a->data + len, '\n', n);
+        len += n;
+        arena_touch(a, len);
+        if (eol) {
+            const size_t end = eol - a->data;
+            const size_t rest = len - end - 1;
+            if (rest > 0) {
+                /* give it back if possible, so that it is not lost at exit */
+                if (lseek(STDIN_FILENO, -(off_t)rest, SEEK_CUR) < 0
+                    && stash_pending(eol + 1, rest, a->max_size) < 0)
+                    return -1;
+                paskuda_wipe(eol + 1, rest);
+            }
+            return end - base;
+        }
+    }
+}
+
+static int setup()
+{
+    if (page_size > 0)
+        return 0;
+    errno = EOVERFLOW;
+    const long n = sysconf(_SC_PAGESIZE);
+    if (n < 0)
+        return -1;
+    if (mlock(&out_buf, sizeof out_buf) < 0)
+        return -1;
+    /* whether or not there is a terminal, exit() wipes the secrets */
+    if (atexit(restore_tty_at_exit) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    msg_init(&msg_press_tab);
+    msg_init(&msg_no_echo);
+    page_size = n;
+    return 0;
+}
+
+struct paskuda_secret *paskuda_alloc(size_t max_size)
+{
+    if (setup() < 0)
+        return NULL;
+    struct secret *s = malloc(sizeof *s);
+    if (s == NULL)
+        return NULL;
+    if (arena_init(&s->arena, max_size) < 0) {
+        free(s);
+        return NULL;
+    }
+    s->pub.data = s->arena.data;
+    s->pub.len = 0;
+    s->prev = NULL;
+    s->next = secrets;
+    if (secrets)
+        secrets->prev = s;
+    secrets = s;
+    return &s->pub;
+}
+
+int paskuda_reserve(struct paskuda_secret *secret, size_t size)
+{
+    struct secret *s = (struct secret *)secret;
+    if (arena_reserve(&s->arena, size) < 0)
+        return -1;
+    /* the caller may write anywhere in there */
+    arena_touch(&s->arena, size);
+    return 0;
+}
+
+void paskuda_free(struct paskuda_secret *secret)
+{
+    if (secret == NULL)
+        return;
+    struct secret *s = (struct secret *)secret;
+    arena_touch(&s->arena, secret->len + 1);
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        secrets = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    arena_free(&s->arena);
+    free(s);
+}
+
+int paskuda_read_append(const char *prompt, const struct paskuda_opts *opts, struct paskuda_secret *secret)
+{
+    static const struct paskuda_opts default_opts;
+    if (opts == NULL)
+        opts = &default_opts;
+    if (prompt == NULL)
+        prompt = "Password:";
+    struct arena *a = &((struct secret *)secret)->arena;
+    const size_t base = secret->len;
+    if (setup() < 0 || arena_reserve(a, base + 1) < 0)
+        return -1;
+    catch_signals();
+    ansi = opts->ansi > 0 || (opts->ansi == 0 && term_is_ansi());
+    keep_typeahead = opts->typeahead;
+    stats = opts->stats;
+    if (stats)
+        memset(stats, 0, sizeof *stats);
+    first_input_us = 0;
+    input_timeout.total = opts->timeout;
+    input_timeout.idle = opts->idle_timeout;
+    start_timeout();
+    ssize_t len;
+    int eof = 0;
+    if (isatty(STDIN_FILENO)) {
+        if (tty_fd < 0 && init_tty(STDIN_FILENO) < 0)
+            goto error;
+        if (echo_fd < 0) {
+            echo_fd = open_echo_fd();
+            echo_nonblock = echo_fd >= 0;
+            if (!echo_nonblock)
+                echo_fd = STDERR_FILENO;
+        }
+        len = read_tty(prompt, opts->echo, a, base);
+        arena_wipe(&starts);
+    } else
+        len = read_stream(a, base, &eof);
+    if (len < 0)
+        goto error;
+    if (stats && first_input_us)
+        stats->typing_us = monotonic_us() - first_input_us;
+    stats = NULL;
+    if (!opts->keep_tty && restore_tty() < 0)
+        goto error;
+    if (eof)
+        return 0;
+    secret->len = base + len;
+    secret->data[secret->len] = '\0';
+    arena_touch(a, secret->len + 1);
+    return 1;
+error:;
+    const int orig_errno = errno;
+    stats = NULL;
+    if (a->used > base)
+        paskuda_wipe(a->data + base, a->used - base);
+    a->used = base;
+    out_discard();
+    out_buf.lossy = 0;
+    if (tty_fd >= 0) {
+        out_puts(echo_fd, "\n");
+        out_flush(echo_fd);
+    }
+    out_buf.error = 0;
+    restore_tty();
+    errno = orig_errno;
+    return -1;
+}
+
+int paskuda_read(const char *prompt, const struct paskuda_opts *opts, struct paskuda_secret **secret)
+{
+    *secret = NULL;
+    struct paskuda_secret *result = paskuda_alloc(opts && opts->max_size ? opts->max_size : 64 << 10);
+    if (result == NULL)
+        return -1;
+    const int rc = paskuda_read_append(prompt, opts, result);
+    if (rc <= 0) {
+        const int orig_errno = errno;
+        paskuda_free(result);
+        errno = orig_errno;
+        return rc;
+    }
+    *secret = result;
+    return 1;
+}
+
+void paskuda_end(void)
+{
+    restore_tty();
+    if (echo_nonblock)
+        close(echo_fd);
+    echo_fd = -1;
+    echo_nonblock = 0;
+    pending.len = 0;
+    arena_free(&pending.arena);
+    arena_free(&starts);
+}
+
+/* vim:set ts=4 sts=4 sw=4 et:*/
@@ -2,215 +2,1664 @@
  * SPDX-License-Identifier: MIT
  */
 
-#include <assert.h>
+#define _GNU_SOURCE /* memfd_create(), F_ADD_SEALS */
+
 #include <errno.h>
-#include <stdarg.h>
-#include <stdio.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
-#include <termios.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef __linux__
+#include <dirent.h>
+#include <linux/keyctl.h>
+#include <sys/inotify.h>
 #include <sys/prctl.h>
+#include <sys/syscall.h>
 #endif
 
+#include "hash.h"
+#include "paskuda.h"
+#include "util.h"
+
 #define PROGRAM_NAME "paskuda"
 
-static void show_usage(FILE *fp)
+#define EXIT_TIMEOUT 124
+
+#define IOV_STR(s) { .iov_base = (void *)(s), .iov_len = strlen(s) }
+
+/* Diagnostics are written with a single writev(), without stdio. */
+static void print_msg(const char *msg)
+{
+    struct iovec iov[] = { IOV_STR(msg) };
+    while (writev(STDERR_FILENO, iov, 1) < 0 && errno == EINTR)
+        ;
+}
+
+static void print_error(const char *context, const char *msg)
+{
+    struct iovec iov[] = {
+        IOV_STR(PROGRAM_NAME ": "),
+        IOV_STR(context),
+        IOV_STR(msg ? ": " : ""),
+        IOV_STR(msg ? msg : ""),
+        IOV_STR("\n"),
+    };
+    while (writev(STDERR_FILENO, iov, sizeof iov / sizeof *iov) < 0 && errno == EINTR)
+        ;
+}
+
+static void xerror(const char *context)
+{
+    print_error(context, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+static void fatal(const char *msg)
+{
+    print_error(msg, NULL);
+    exit(EXIT_FAILURE);
+}
+
+/* Concatenate a and b into buf; return -1 if they don't fit. */
+static int concat(char *buf, size_t size, const char *a, const char *b)
+{
+    const size_t a_len = strlen(a);
+    const size_t b_len = strlen(b);
+    if (a_len + b_len >= size)
+        return -1;
+    memcpy(buf, a, a_len);
+    memcpy(buf + a_len, b, b_len + 1);
+    return 0;
+}
+
+static void xwritev(int fd, struct iovec *iov, int iovcnt)
 {
-    fprintf(fp, "Usage: %s [PROMPT]\n", PROGRAM_NAME);
-    if (fp != stdout)
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+                if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+                    xerror("poll()");
+                continue;
+            }
+            xerror("writev()");
+        }
+        for (; iovcnt > 0 && (size_t)n >= iov->iov_len; iov++, iovcnt--)
+            n -= iov->iov_len;
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+static void xwrite(int fd, const char *s, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, s, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+                if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+                    xerror("poll()");
+                continue;
+            }
+            xerror("write()");
+        }
+        s += n;
+        len -= n;
+    }
+}
+
+#define USAGE "Usage: " PROGRAM_NAME " [OPTIONS] [PROMPT] [-- COMMAND [ARG...]]\n"
+
+static void show_usage(int fd)
+{
+    if (fd != STDOUT_FILENO) {
+        print_msg(USAGE);
         return;
-    fprintf(fp,
+    }
+    static const char help[] =
+        USAGE
         "\n"
         "Options:\n"
-        "  -h, --help  show this help message and exit\n"
-    );
+        "  --agent             run a credential caching agent\n"
+        "  --ansi              erase using ANSI cursor control sequences\n"
+        "  --ask-password-agent\n"
+        "                      answer systemd password requests, one after\n"
+        "                      another, until end of input\n"
+        "  --cache             get the secret from the agent, or store it there\n"
+        "  --confirm           read each secret twice, until both entries match\n"
+        "  --count=N           read N secrets, each terminated by NUL\n"
+        "                      (unless --format is given)\n"
+        "  --fd=N              pass secrets to COMMAND on descriptor N (default: 3)\n"
+        "  --field=NAME:PROMPT[:echo|:noecho]\n"
+        "                      read a field of a form; can be repeated\n"
+        "                      (the fields are output as a single record,\n"
+        "                      framed like the names and values in it)\n"
+        "  --format=FORMAT     frame each secret as raw, nul (terminated by NUL),\n"
+        "                      netstring (LENGTH:DATA,), or u32le (preceded by\n"
+        "                      its length as 32-bit little-endian integer)\n"
+        "  --hash=sha256       output the SHA-256 digest of the secret instead\n"
+        "  --hash=argon2id[,t=N][,m=SIZE][,p=N]\n"
+        "                      output a 32-byte key derived with Argon2id instead\n"
+        "                      (default: t=3, m=64M, p=4; lanes run in parallel)\n"
+        "  --idle-timeout=SECONDS\n"
+        "                      give up after SECONDS without input\n"
+        "  --key=NAME          cache the secret under NAME rather than the prompt\n"
+        "                      (implies --cache)\n"
+        "  --keyring           cache the secret in the kernel session keyring\n"
+        "                      rather than in the agent (implies --cache)\n"
+        "  --max-size=SIZE     allow secrets of up to SIZE bytes (default: 64K)\n"
+        "  --memfd             send each secret as a sealed memfd over the stdout\n"
+        "                      socket, or pass a sealed memfd to COMMAND\n"
+        "  --prompt-file=FILE  read prompts from FILE, one per line\n"
+        "  --salt=SALT         salt for Argon2id\n"
+        "  --socket=PATH       agent socket path\n"
+        "  --stats             print I/O statistics for each secret to stderr\n"
+        "  --timeout=SECONDS   give up if the secret is not entered within SECONDS\n"
+        "  --trace-fd=N        print the statistics to descriptor N (implies --stats)\n"
+        "  --ttl=SECONDS       forget cached secrets after SECONDS (default: 300)\n"
+        "  --typeahead         keep input typed before the prompt, even though\n"
+        "                      the terminal may have echoed it, and after the\n"
+        "                      secret; input is then read a byte at a time\n"
+        "  -h, --help          show this help message and exit\n"
+        "\n"
+        "If stdin is not a terminal, each secret is a line read from it.\n"
+        "A pipe is read in chunks, so the input after the last line used is lost.\n"
+    ;
+    xwrite(fd, help, sizeof help - 1);
 }
 
-static void xerror(const char *context)
+static void send_fd(int sock, int fd)
 {
-    int orig_errno = errno;
-    fprintf(stderr, "%s: ", PROGRAM_NAME);
-    errno = orig_errno;
-    perror(context);
-    exit(EXIT_FAILURE);
+    char byte = '\0';
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    union {
+        struct cmsghdr hdr;
+        char data[CMSG_SPACE(sizeof fd)];
+    } control;
+    memset(&control, 0, sizeof control);
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.data,
+        .msg_controllen = sizeof control.data,
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof fd);
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof fd);
+    while (sendmsg(sock, &msg, 0) < 0)
+        if (errno != EINTR)
+            xerror("sendmsg()");
+}
+
+static int memfd_new()
+{
+#ifdef __linux__
+    int fd = memfd_create(PROGRAM_NAME, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+        xerror("memfd_create()");
+    return fd;
+#else
+    errno = ENOSYS;
+    xerror("memfd_create()");
+    return -1;
+#endif
+}
+
+static void memfd_seal(int fd)
+{
+#ifdef __linux__
+    const int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL;
+    if (fcntl(fd, F_ADD_SEALS, seals) < 0)
+        xerror("fcntl(F_ADD_SEALS)");
+#endif
+    /* the file offset is shared with the receiver */
+    if (lseek(fd, 0, SEEK_SET) < 0)
+        xerror("lseek()");
+}
+
+static int make_memfd(const char *s, size_t len)
+{
+    int fd = memfd_new();
+    xwrite(fd, s, len);
+    memfd_seal(fd);
+    return fd;
+}
+
+enum format {
+    FORMAT_DEFAULT, /* raw, or nul in batch mode, or u32le in form mode */
+    FORMAT_RAW,
+    FORMAT_NUL,
+    FORMAT_NETSTRING,
+    FORMAT_U32LE,
+};
+
+static struct {
+    enum format format;
+    int memfd;
+    char **command;
+    int fd; /* descriptor number for the command */
+    int sink;
+    struct paskuda_secret *queue; /* framed secrets for the command's pipe */
+    pid_t pid;
+} output = {
+    .fd = 3,
+    .sink = STDOUT_FILENO,
+    .pid = -1,
+};
+
+/* what goes around a secret of the given length */
+struct frame {
+    char header[24];
+    size_t header_len;
+    char trailer[1];
+    size_t trailer_len;
+};
+
+static void make_frame(struct frame *f, size_t len)
+{
+    f->header_len = f->trailer_len = 0;
+    switch (output.format) {
+    case FORMAT_NUL:
+        f->trailer[f->trailer_len++] = '\0';
+        break;
+    case FORMAT_NETSTRING:
+        f->header_len = format_size(f->header, len);
+        f->header[f->header_len++] = ':';
+        f->trailer[f->trailer_len++] = ',';
+        break;
+    case FORMAT_U32LE:
+        if (len > UINT32_MAX)
+            fatal("secret too long for --format=u32le");
+        store32_le(f->header, len);
+        f->header_len = 4;
+        break;
+    default:
+        break;
+    }
+}
+
+static int parse_format(const char *s)
+{
+    static const char *const names[] = {
+        [FORMAT_RAW] = "raw",
+        [FORMAT_NUL] = "nul",
+        [FORMAT_NETSTRING] = "netstring",
+        [FORMAT_U32LE] = "u32le",
+    };
+    for (size_t i = FORMAT_RAW; i < sizeof names / sizeof *names; i++)
+        if (strcmp(s, names[i]) == 0) {
+            output.format = i;
+            return 0;
+        }
+    return -1;
 }
 
-typedef void *(*memset_fn) (void *s, int c, size_t n);
-static const volatile memset_fn xmemset = memset;
+/* what is output in place of the secret */
+static struct {
+    enum { HASH_NONE, HASH_SHA256, HASH_ARGON2ID } type;
+    struct argon2_params argon2;
+    const char *salt;
+} hash = {
+    /* the second recommended option of RFC 9106 */
+    .argon2 = { .t_cost = 3, .m_cost = 64 << 10, .lanes = 4 },
+};
 
-static int tty_fd = -1;
-static struct termios orig_tio;
+extern char **environ;
 
-static void restore_tty()
+static void spawn_command()
 {
-    if (tty_fd < 0)
+    int pipefd[2];
+    if (pipe(pipefd) < 0)
+        xerror("pipe()");
+    if (fcntl(pipefd[1], F_SETFD, FD_CLOEXEC) < 0)
+        xerror("fcntl(F_SETFD)");
+    posix_spawn_file_actions_t actions;
+    int rc = posix_spawn_file_actions_init(&actions);
+    if (rc == 0 && pipefd[0] != output.fd) {
+        rc = posix_spawn_file_actions_adddup2(&actions, pipefd[0], output.fd);
+        if (rc == 0)
+            rc = posix_spawn_file_actions_addclose(&actions, pipefd[0]);
+    }
+    if (rc != 0) {
+        errno = rc;
+        xerror("posix_spawn_file_actions");
+    }
+    rc = posix_spawnp(&output.pid, output.command[0], &actions, NULL, output.command, environ);
+    if (rc != 0) {
+        errno = rc;
+        xerror(output.command[0]);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    close(pipefd[0]);
+    output.sink = pipefd[1];
+}
+
+static void emit_secret(const char *s, size_t len)
+{
+    if (output.memfd && output.command == NULL) {
+        int fd = make_memfd(s, len);
+        send_fd(STDOUT_FILENO, fd);
+        close(fd);
         return;
-    int rc = tcsetattr(tty_fd, TCSAFLUSH, &orig_tio);
-    if (rc < 0)
-        xerror("tcsetattr()");
-    tty_fd = -1;
+    }
+    /* memfd exec mode, first secret */
+    if (output.sink < 0 && output.queue == NULL)
+        output.sink = memfd_new();
+    struct frame f;
+    make_frame(&f, len);
+    if (output.queue) {
+        /* the command is started only when the terminal is restored */
+        struct paskuda_secret *q = output.queue;
+        const size_t off = q->len;
+        if (paskuda_reserve(q, off + f.header_len + len + f.trailer_len + 1) < 0)
+            xerror("paskuda_reserve()");
+        memcpy(q->data + off, f.header, f.header_len);
+        memcpy(q->data + off + f.header_len, s, len);
+        memcpy(q->data + off + f.header_len + len, f.trailer, f.trailer_len);
+        q->len += f.header_len + len + f.trailer_len;
+        q->data[q->len] = '\0';
+        return;
+    }
+    struct iovec iov[] = {
+        { .iov_base = f.header, .iov_len = f.header_len },
+        { .iov_base = (void *)s, .iov_len = len },
+        { .iov_base = f.trailer, .iov_len = f.trailer_len },
+    };
+    xwritev(output.sink, iov, 3);
 }
 
-static void init_tty(int fd)
+/* Emit the digest of the secret rather than the secret itself. */
+static void emit_digest(const char *s, size_t len)
 {
-    struct termios tio;
-    int rc = tcgetattr(fd, &tio);
-    if (rc < 0)
-        xerror("tcgetattr()");
-    orig_tio = tio;
-    tio.c_lflag &= ~(ECHO | ICANON);
-    rc = tcsetattr(fd, TCSAFLUSH, &tio);
+    const size_t size = SHA256_SIZE; /* used for Argon2id too */
+    struct paskuda_secret *digest = paskuda_alloc(size + 1);
+    if (digest == NULL || paskuda_reserve(digest, size + 1) < 0)
+        xerror("paskuda_alloc()");
+    if (hash.type == HASH_SHA256)
+        sha256(s, len, (unsigned char *)digest->data);
+    else if (argon2id(s, len, hash.salt, strlen(hash.salt), &hash.argon2, digest->data, size) < 0)
+        xerror("argon2id()");
+    digest->len = size;
+    digest->data[size] = '\0';
+    emit_secret(digest->data, digest->len);
+    paskuda_free(digest);
+}
+
+static void emit(const char *s, size_t len)
+{
+    if (hash.type == HASH_NONE)
+        emit_secret(s, len);
+    else
+        emit_digest(s, len);
+}
+
+/* Hand the secrets over to the command, if any, and return the exit status.
+ * With a memfd there is nothing left to do for paskuda, so it is replaced
+ * by the command. Must be called after paskuda_end(). */
+static int run_command()
+{
+    if (output.command == NULL)
+        return EXIT_SUCCESS;
+    if (output.memfd) {
+        memfd_seal(output.sink);
+        if (output.sink == output.fd) {
+            if (fcntl(output.sink, F_SETFD, 0) < 0)
+                xerror("fcntl(F_SETFD)");
+        } else if (dup2(output.sink, output.fd) < 0)
+            xerror("dup2()");
+        execvp(output.command[0], output.command);
+        xerror(output.command[0]);
+    }
+    spawn_command();
+    /* after the spawn, so that the command gets the default disposition */
+    signal(SIGPIPE, SIG_IGN);
+    const char *s = output.queue->data;
+    size_t len = output.queue->len;
+    while (len > 0) {
+        ssize_t n = write(output.sink, s, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EPIPE)
+                break; /* the command did not read it all; its status tells */
+            xerror("write()");
+        }
+        s += n;
+        len -= n;
+    }
+    paskuda_free(output.queue);
+    output.queue = NULL;
+    close(output.sink);
+    int status;
+    while (waitpid(output.pid, &status, 0) < 0)
+        if (errno != EINTR)
+            xerror("waitpid()");
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return WEXITSTATUS(status);
+}
+
+/* Read the whole file, NUL-terminated; return NULL and set errno on error. */
+static char *read_file(const char *path, size_t *result_len)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    size_t size = 4096;
+    size_t len = 0;
+    char *data = malloc(size);
+    if (data == NULL)
+        xerror("malloc()");
+    while (1) {
+        if (len + 1 == size) {
+            size *= 2;
+            data = realloc(data, size);
+            if (data == NULL)
+                xerror("realloc()");
+        }
+        ssize_t n = read(fd, data + len, size - len - 1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            const int orig_errno = errno;
+            close(fd);
+            free(data);
+            errno = orig_errno;
+            return NULL;
+        }
+        if (n == 0)
+            break;
+        len += n;
+    }
+    close(fd);
+    data[len] = '\0';
+    *result_len = len;
+    return data;
+}
+
+static char **read_prompts(const char *path, size_t *count)
+{
+    size_t len;
+    char *data = read_file(path, &len);
+    if (data == NULL)
+        xerror(path);
+    /* the lines are split in place */
+    char **prompts = NULL;
+    size_t n = 0;
+    for (char *line = data; line < data + len; n++) {
+        char *eol = memchr(line, '\n', data + len - line);
+        if (eol == NULL)
+            eol = data + len;
+        *eol = '\0';
+        char **p = realloc(prompts, (n + 1) * sizeof *prompts);
+        if (p == NULL)
+            xerror("realloc()");
+        prompts = p;
+        prompts[n] = line;
+        line = eol + 1;
+    }
+    *count = n;
+    return prompts;
+}
+
+/* Credential caching agent.
+ *
+ * The agent listens on a Unix socket that only its owner may connect to,
+ * and keeps the secrets in its locked arena, each entry laid out as
+ * struct agent_entry, the key, and the value. Requests are:
+ *
+ *   'G' <u32 key length> <key>
+ *   'P' <u32 key length> <key> <u32 value length> <value>
+ *
+ * A 'G' is answered with '+' <u32 length> <value>, or with '-' on a miss;
+ * a 'P' with '+' or '-'. Integers are little-endian, as in --format=u32le. */
+
+struct agent_entry {
+    uint32_t key_len;
+    uint32_t value_len;
+    int64_t expiry;
+};
+
+#define AGENT_MAX_KEY_LEN 4096
+
+static int recv_all(int fd, void *buf, size_t len)
+{
+    char *s = buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, s, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        s += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int send_all(int fd, const void *buf, size_t len)
+{
+    const char *s = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, s, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        s += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static const char *agent_socket_path(const char *path)
+{
+    if (path)
+        return path;
+    path = getenv("PASKUDA_AGENT_SOCKET");
+    if (path && *path)
+        return path;
+    static char buf[sizeof ((struct sockaddr_un *)NULL)->sun_path];
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    int rc;
+    if (dir && *dir)
+        rc = concat(buf, sizeof buf, dir, "/" PROGRAM_NAME "-agent");
+    else {
+        char uid[24];
+        uid[format_size(uid, getuid())] = '\0';
+        rc = concat(buf, sizeof buf, "/tmp/" PROGRAM_NAME "-agent-", uid);
+    }
     if (rc < 0)
-        xerror("tcsetattr()");
-    tty_fd = fd;
-    atexit(restore_tty);
+        fatal("agent socket path too long");
+    return buf;
+}
+
+static int agent_sockaddr(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof *addr);
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof addr->sun_path) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+static int peer_is_owner(int fd)
+{
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof cred;
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+        return 0;
+    return cred.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    if (getpeereid(fd, &uid, &gid) < 0)
+        return 0;
+    return uid == getuid();
+#endif
+}
+
+/* Connect to the agent; return -1 if there is no usable agent. */
+static int agent_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    if (agent_sockaddr(path, &addr) < 0)
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        xerror("socket()");
+    if (connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0 || !peer_is_owner(fd)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int send_u32(int fd, uint32_t x)
+{
+    char buf[4];
+    store32_le(buf, x);
+    return send_all(fd, buf, sizeof buf);
+}
+
+static int recv_u32(int fd, uint32_t *x)
+{
+    char buf[4];
+    if (recv_all(fd, buf, sizeof buf) < 0)
+        return -1;
+    *x = load32_le(buf);
+    return 0;
+}
+
+static int agent_send_key(int fd, char op, const char *key)
+{
+    uint32_t key_len = strlen(key);
+    if (key_len > AGENT_MAX_KEY_LEN)
+        return -1;
+    if (send_all(fd, &op, 1) < 0 || send_u32(fd, key_len) < 0)
+        return -1;
+    return send_all(fd, key, key_len);
+}
+
+/* Look up key in the agent, reading the value into the secret.
+ * Return 0, or -1 on a miss. */
+static int agent_get(const char *path, const char *key, struct paskuda_secret *secret)
+{
+    int fd = agent_connect(path);
+    if (fd < 0)
+        return -1;
+    int result = -1;
+    char status;
+    uint32_t len;
+    if (agent_send_key(fd, 'G', key) < 0)
+        goto out;
+    if (recv_all(fd, &status, 1) < 0 || status != '+')
+        goto out;
+    if (recv_u32(fd, &len) < 0)
+        goto out;
+    if (paskuda_reserve(secret, (size_t)len + 1) < 0)
+        goto out;
+    if (recv_all(fd, secret->data, len) < 0) {
+        paskuda_wipe(secret->data, len);
+        goto out;
+    }
+    secret->data[len] = '\0';
+    secret->len = len;
+    result = 0;
+out:
+    close(fd);
+    return result;
+}
+
+static void agent_put(const char *path, const char *key, const char *s, size_t len)
+{
+    if (len > UINT32_MAX)
+        return;
+    int fd = agent_connect(path);
+    if (fd < 0)
+        return;
+    char status;
+    if (agent_send_key(fd, 'P', key) == 0)
+        if (send_u32(fd, len) == 0)
+            if (send_all(fd, s, len) == 0)
+                recv_all(fd, &status, 1);
+    close(fd);
+}
+
+/* the entries, agent_store->len bytes in total */
+static struct paskuda_secret *agent_store;
+
+static size_t agent_entry_size(const char *p)
+{
+    struct agent_entry e;
+    memcpy(&e, p, sizeof e);
+    return sizeof e + e.key_len + e.value_len;
+}
+
+static void agent_remove(char *p)
+{
+    const size_t size = agent_entry_size(p);
+    char *end = agent_store->data + agent_store->len;
+    memmove(p, p + size, end - (p + size));
+    agent_store->len -= size;
+    paskuda_wipe(agent_store->data + agent_store->len, size);
+}
+
+static char *agent_find(const char *key, size_t key_len)
+{
+    for (char *p = agent_store->data; p < agent_store->data + agent_store->len; p += agent_entry_size(p)) {
+        struct agent_entry e;
+        memcpy(&e, p, sizeof e);
+        if (e.key_len == key_len && memcmp(p + sizeof e, key, key_len) == 0)
+            return p;
+    }
+    return NULL;
+}
+
+/* Drop expired entries; return the number of milliseconds until the next
+ * expiry, or -1. */
+static int64_t agent_expire(int64_t now)
+{
+    int64_t next = -1;
+    char *p = agent_store->data;
+    while (p < agent_store->data + agent_store->len) {
+        struct agent_entry e;
+        memcpy(&e, p, sizeof e);
+        if (e.expiry <= now) {
+            agent_remove(p);
+            continue;
+        }
+        if (next < 0 || e.expiry - now < next)
+            next = e.expiry - now;
+        p += agent_entry_size(p);
+    }
+    return next;
 }
 
-static void xprintf(int fd, const char *fmt, ...)
+static void agent_handle(int fd, int64_t ttl)
 {
-    va_list ap;
-    va_start(ap, fmt);
-    int rc = vdprintf(fd, fmt, ap);
+    char op;
+    uint32_t key_len;
+    char key[AGENT_MAX_KEY_LEN];
+    if (recv_all(fd, &op, 1) < 0 || recv_u32(fd, &key_len) < 0)
+        return;
+    if (key_len > sizeof key || recv_all(fd, key, key_len) < 0)
+        return;
+    char *p = agent_find(key, key_len);
+    if (op == 'G') {
+        if (p == NULL) {
+            send_all(fd, "-", 1);
+            return;
+        }
+        struct agent_entry e;
+        memcpy(&e, p, sizeof e);
+        if (send_all(fd, "+", 1) == 0 && send_u32(fd, e.value_len) == 0)
+            send_all(fd, p + sizeof e + e.key_len, e.value_len);
+        return;
+    }
+    if (op != 'P')
+        return;
+    uint32_t value_len;
+    if (recv_u32(fd, &value_len) < 0)
+        return;
+    if (p)
+        agent_remove(p);
+    struct agent_entry e = {
+        .key_len = key_len,
+        .value_len = value_len,
+        .expiry = monotonic_ms() + ttl * 1000,
+    };
+    const size_t size = sizeof e + key_len + value_len;
+    if (paskuda_reserve(agent_store, agent_store->len + size) < 0) {
+        send_all(fd, "-", 1);
+        return;
+    }
+    p = agent_store->data + agent_store->len;
+    if (recv_all(fd, p + sizeof e + key_len, value_len) < 0) {
+        paskuda_wipe(p, size);
+        return;
+    }
+    memcpy(p, &e, sizeof e);
+    memcpy(p + sizeof e, key, key_len);
+    agent_store->len += size;
+    send_all(fd, "+", 1);
+}
+
+static volatile sig_atomic_t agent_quit = 0;
+
+static void agent_on_signal(int sig)
+{
+    (void) sig;
+    agent_quit = 1;
+}
+
+static void run_agent(const char *path, int64_t ttl, size_t max_size)
+{
+    struct sockaddr_un addr;
+    if (agent_sockaddr(path, &addr) < 0)
+        xerror(path);
+    int fd = agent_connect(path);
+    if (fd >= 0)
+        fatal("agent is already running");
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode) && st.st_uid == getuid())
+        unlink(path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        xerror("socket()");
+    mode_t orig_umask = umask(0177);
+    int rc = bind(fd, (struct sockaddr *)&addr, sizeof addr);
+    umask(orig_umask);
     if (rc < 0)
-        xerror("dprintf()");
-    va_end(ap);
+        xerror(path);
+    if (listen(fd, 16) < 0)
+        xerror("listen()");
+    struct sigaction sa = { .sa_handler = agent_on_signal };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    agent_store = paskuda_alloc(max_size);
+    if (agent_store == NULL)
+        xerror("paskuda_alloc()");
+    while (!agent_quit) {
+        int64_t next = agent_expire(monotonic_ms());
+        int timeout = next > INT_MAX ? INT_MAX : next;
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        rc = poll(&pfd, 1, timeout);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            xerror("poll()");
+        }
+        if (rc == 0)
+            continue;
+        int cfd = accept(fd, NULL, NULL);
+        if (cfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            xerror("accept()");
+        }
+        struct timeval tv = { .tv_sec = 1 };
+        setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+        setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+        if (peer_is_owner(cfd))
+            agent_handle(cfd, ttl);
+        close(cfd);
+    }
+    unlink(path);
+    close(fd);
+    paskuda_free(agent_store);
+}
+
+/* Linux kernel keyring backend: secrets are stored as "user" keys named
+ * "paskuda:KEY" in the session keyring, with a timeout. */
+
+static int keyring_description(const char *key, char *buf, size_t size)
+{
+    return concat(buf, size, PROGRAM_NAME ":", key);
+}
+
+static int keyring_get(const char *key, struct paskuda_secret *secret)
+{
+#ifdef __linux__
+    char desc[4096];
+    if (keyring_description(key, desc, sizeof desc) < 0)
+        return -1;
+    long id = syscall(SYS_keyctl, KEYCTL_SEARCH, KEY_SPEC_SESSION_KEYRING, "user", desc, 0);
+    if (id < 0)
+        return -1;
+    long size = syscall(SYS_keyctl, KEYCTL_READ, id, NULL, 0);
+    if (size < 0 || paskuda_reserve(secret, (size_t)size + 1) < 0)
+        return -1;
+    long len = syscall(SYS_keyctl, KEYCTL_READ, id, secret->data, size);
+    if (len < 0 || len > size) /* the key was updated in the meantime */
+        return -1;
+    secret->data[len] = '\0';
+    secret->len = len;
+    return 0;
+#else
+    (void) key;
+    (void) secret;
+    return -1;
+#endif
+}
+
+static void keyring_put(const char *key, const char *s, size_t len, unsigned long ttl)
+{
+#ifdef __linux__
+    char desc[4096];
+    if (keyring_description(key, desc, sizeof desc) < 0)
+        return;
+    long id = syscall(SYS_add_key, "user", desc, s, len, KEY_SPEC_SESSION_KEYRING);
+    if (id < 0)
+        return;
+    syscall(SYS_keyctl, KEYCTL_SET_TIMEOUT, id, ttl);
+#else
+    (void) key;
+    (void) s;
+    (void) len;
+    (void) ttl;
+#endif
+}
+
+/* one line of key=value pairs */
+static void write_stats(int fd, const struct paskuda_stats *stats)
+{
+    const struct {
+        const char *name;
+        unsigned long value;
+    } fields[] = {
+        { "reads", stats->reads },
+        { "read_bytes", stats->read_bytes },
+        { "max_read_bytes", stats->max_read_bytes },
+        { "writes", stats->writes },
+        { "echo_bytes", stats->echo_bytes },
+        { "read_us", stats->read_us },
+        { "write_us", stats->write_us },
+        { "typing_us", stats->typing_us },
+    };
+    char buf[512];
+    size_t len = 0;
+    for (size_t i = 0; i < sizeof fields / sizeof *fields; i++) {
+        const size_t name_len = strlen(fields[i].name);
+        if (i > 0)
+            buf[len++] = ' ';
+        memcpy(buf + len, fields[i].name, name_len);
+        len += name_len;
+        buf[len++] = '=';
+        len += format_size(buf + len, fields[i].value);
+    }
+    buf[len++] = '\n';
+    xwrite(fd, buf, len);
+}
+
+static int parse_uint(const char *s, unsigned long max, unsigned long *result)
+{
+    char *end;
+    errno = 0;
+    unsigned long n = strtoul(s, &end, 10);
+    if (errno || end == s || *end || s[0] == '-' || n > max)
+        return -1;
+    *result = n;
+    return 0;
+}
+
+static int parse_size(const char *s, size_t *result)
+{
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(s, &end, 10);
+    if (errno || end == s || s[0] == '-')
+        return -1;
+    unsigned int shift = 0;
+    switch (*end) {
+    case 'K':
+        shift = 10;
+        end++;
+        break;
+    case 'M':
+        shift = 20;
+        end++;
+        break;
+    case 'G':
+        shift = 30;
+        end++;
+        break;
+    }
+    if (*end)
+        return -1;
+    if (n > (SIZE_MAX >> shift))
+        return -1;
+    *result = (size_t)n << shift;
+    return 0;
+}
+
+struct field {
+    const char *name;
+    const char *prompt;
+    int echo;
+};
+
+/* Parse NAME:PROMPT[:echo|noecho]; the spec is modified in place. */
+static int parse_field(char *spec, struct field *field)
+{
+    char *colon = strchr(spec, ':');
+    if (colon == NULL || colon == spec)
+        return -1;
+    *colon = '\0';
+    field->name = spec;
+    field->prompt = colon + 1;
+    field->echo = 0;
+    char *mode = strrchr(colon + 1, ':');
+    if (mode) {
+        if (strcmp(mode, ":echo") == 0)
+            field->echo = 1;
+        else if (strcmp(mode, ":noecho") != 0)
+            mode = NULL;
+    }
+    if (mode)
+        *mode = '\0';
+    return 0;
+}
+
+/* Parse sha256 or argon2id[,t=N][,m=SIZE][,p=N]; the spec is modified in place. */
+static int parse_hash(char *spec)
+{
+    char *param = strchr(spec, ',');
+    if (param)
+        *param++ = '\0';
+    if (strcmp(spec, "sha256") == 0) {
+        hash.type = HASH_SHA256;
+        return param ? -1 : 0;
+    }
+    if (strcmp(spec, "argon2id") != 0)
+        return -1;
+    hash.type = HASH_ARGON2ID;
+    while (param) {
+        char *next = strchr(param, ',');
+        if (next)
+            *next++ = '\0';
+        unsigned long n;
+        size_t size;
+        if (strncmp(param, "t=", 2) == 0 && parse_uint(param + 2, UINT32_MAX, &n) == 0 && n > 0)
+            hash.argon2.t_cost = n;
+        else if (strncmp(param, "m=", 2) == 0 && parse_size(param + 2, &size) == 0 && size / 1024 <= UINT32_MAX)
+            hash.argon2.m_cost = size / 1024;
+        else if (strncmp(param, "p=", 2) == 0 && parse_uint(param + 2, 0xFFFFFF, &n) == 0 && n > 0)
+            hash.argon2.lanes = n;
+        else
+            return -1;
+        param = next;
+    }
+    return 0;
+}
+
+static void read_failed(void)
+{
+    if (errno == ETIMEDOUT) {
+        print_error("timed out", NULL);
+        exit(EXIT_TIMEOUT);
+    }
+    xerror("paskuda_read()");
+}
+
+/* Compare in time that depends only on the lengths. */
+static int secret_equal(const char *s, size_t s_len, const char *t, size_t t_len)
+{
+    const size_t n = s_len < t_len ? s_len : t_len;
+    volatile unsigned char diff = s_len != t_len;
+    for (size_t i = 0; i < n; i++)
+        diff |= s[i] ^ t[i];
+    return diff == 0;
+}
+
+/* Read the secret, and then again, until both entries match;
+ * the terminal is set up only once. */
+static int read_confirmed(const char *prompt, struct paskuda_opts *opts, struct paskuda_secret **result)
+{
+    const size_t retype_size = strlen(prompt) + sizeof "Retype ";
+    char *retype_prompt = malloc(retype_size);
+    if (retype_prompt == NULL)
+        xerror("malloc()");
+    concat(retype_prompt, retype_size, "Retype ", prompt);
+    struct paskuda_secret *secret = paskuda_alloc(opts->max_size);
+    struct paskuda_secret *retyped = paskuda_alloc(opts->max_size);
+    if (secret == NULL || retyped == NULL)
+        xerror("paskuda_alloc()");
+    const int keep_tty = opts->keep_tty;
+    opts->keep_tty = 1;
+    int rc;
+    while ((rc = paskuda_read_append(prompt, opts, secret)) > 0) {
+        rc = paskuda_read_append(retype_prompt, opts, retyped);
+        if (rc < 0)
+            break;
+        if (rc == 0)
+            fatal("unexpected end of input");
+        const int match = secret_equal(secret->data, secret->len, retyped->data, retyped->len);
+        paskuda_wipe(retyped->data, retyped->len);
+        retyped->len = 0;
+        if (match)
+            break;
+        if (!isatty(STDIN_FILENO))
+            fatal("entries do not match");
+        print_error("entries do not match; try again", NULL);
+        paskuda_wipe(secret->data, secret->len);
+        secret->len = 0;
+    }
+    opts->keep_tty = keep_tty;
+    if (rc > 0 && !keep_tty)
+        paskuda_end();
+    free(retype_prompt);
+    const int orig_errno = errno;
+    paskuda_free(retyped);
+    if (rc <= 0) {
+        paskuda_free(secret);
+        secret = NULL;
+    }
+    errno = orig_errno;
+    *result = secret;
+    return rc;
+}
+
+/* Frame the data from off to the end of the record, in place. */
+static void frame_in_place(struct paskuda_secret *record, size_t off)
+{
+    const size_t len = record->len - off;
+    struct frame f;
+    make_frame(&f, len);
+    if (paskuda_reserve(record, record->len + f.header_len + f.trailer_len + 1) < 0)
+        xerror("paskuda_reserve()");
+    char *p = record->data + off;
+    memmove(p + f.header_len, p, len);
+    memcpy(p, f.header, f.header_len);
+    memcpy(p + f.header_len + len, f.trailer, f.trailer_len);
+    record->len += f.header_len + f.trailer_len;
+    record->data[record->len] = '\0';
+}
+
+/* Read all fields into a single record: for each field, the name and then
+ * the value, each framed as requested with --format; the record is then
+ * framed as a whole. */
+static void read_form(const struct field *fields, size_t n_fields, struct paskuda_opts *opts, int stats_fd)
+{
+    struct paskuda_secret *record = paskuda_alloc(opts->max_size);
+    if (record == NULL)
+        xerror("paskuda_alloc()");
+    opts->keep_tty = 1;
+    for (size_t i = 0; i < n_fields; i++) {
+        const size_t name_len = strlen(fields[i].name);
+        size_t off = record->len;
+        if (paskuda_reserve(record, off + name_len + 1) < 0)
+            xerror("paskuda_reserve()");
+        memcpy(record->data + off, fields[i].name, name_len);
+        record->len += name_len;
+        frame_in_place(record, off);
+        off = record->len;
+        opts->echo = fields[i].echo;
+        int rc = paskuda_read_append(fields[i].prompt, opts, record);
+        if (rc < 0)
+            read_failed();
+        if (rc == 0)
+            fatal("unexpected end of input");
+        frame_in_place(record, off);
+        if (stats_fd >= 0)
+            write_stats(stats_fd, opts->stats);
+    }
+    paskuda_end();
+    emit(record->data, record->len);
+    paskuda_free(record);
 }
 
-static void clear_n(int fd, size_t n)
+#ifdef __linux__
+
+/* systemd password agent; see https://systemd.io/PASSWORD_AGENTS/
+ *
+ * Each request is an ask.* file in ASK_PASSWORD_DIR; the answer is sent
+ * to the datagram socket named in the file, as '+' followed by the
+ * password, or as '-' to cancel. */
+
+#define ASK_PASSWORD_DIR "/run/systemd/ask-password"
+
+struct ask {
+    const char *socket;
+    const char *message;
+    int echo;
+    unsigned long pid;
+    unsigned long not_after; /* CLOCK_MONOTONIC, in microseconds; 0 means never */
+};
+
+/* Parse the [Ask] section of the request in place. */
+static int ask_parse(char *data, struct ask *ask)
 {
-    while (n-- > 0)
-        xprintf(fd, "\b \b");
+    *ask = (struct ask) { .message = "Password:" };
+    int in_ask = 0;
+    for (char *line = data; *line; ) {
+        char *eol = strchr(line, '\n');
+        char *next = eol ? eol + 1 : line + strlen(line);
+        if (eol)
+            *eol = '\0';
+        char *eq = strchr(line, '=');
+        if (line[0] == '[')
+            in_ask = strcmp(line, "[Ask]") == 0;
+        else if (in_ask && eq) {
+            *eq = '\0';
+            const char *value = eq + 1;
+            if (strcmp(line, "Socket") == 0)
+                ask->socket = value;
+            else if (strcmp(line, "Message") == 0)
+                ask->message = value;
+            else if (strcmp(line, "Echo") == 0)
+                ask->echo = strcmp(value, "0") != 0;
+            else if (strcmp(line, "PID") == 0)
+                parse_uint(value, INT_MAX, &ask->pid);
+            else if (strcmp(line, "NotAfter") == 0)
+                parse_uint(value, ULONG_MAX, &ask->not_after);
+        }
+        line = next;
+    }
+    return ask->socket ? 0 : -1;
 }
 
-static void clear_s(int fd, const char *s)
+static void ask_reply(const char *path, const char *s, size_t len)
 {
-    clear_n(fd, strlen(s));
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (concat(addr.sun_path, sizeof addr.sun_path, path, "") < 0)
+        return;
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        xerror("socket()");
+    if (sendto(fd, s, len, MSG_NOSIGNAL, (struct sockaddr *)&addr, sizeof addr) < 0)
+        print_error(path, strerror(errno));
+    close(fd);
 }
 
-static const char *prompt = "Password:";
-static const char *msg_press_tab = "(press TAB for no echo) ";
-static const char *msg_no_echo = "(no echo) ";
+/* Answer one request, reading the password into the answer buffer.
+ * Return 0 at end of input. */
+static int ask_handle(const char *name, struct paskuda_secret *answer, struct paskuda_opts *opts)
+{
+    char path[sizeof ASK_PASSWORD_DIR + NAME_MAX + 1];
+    if (concat(path, sizeof path, ASK_PASSWORD_DIR "/", name) < 0)
+        return 1;
+    size_t len;
+    char *data = read_file(path, &len);
+    if (data == NULL)
+        return 1; /* already answered by someone else */
+    int result = 1;
+    struct ask ask;
+    if (ask_parse(data, &ask) < 0)
+        goto out;
+    if (ask.pid > 0 && kill(ask.pid, 0) < 0 && errno == ESRCH)
+        goto out;
+    opts->timeout = 0;
+    if (ask.not_after > 0) {
+        const int64_t left = (int64_t)(ask.not_after / 1000) - monotonic_ms();
+        if (left <= 0)
+            goto out;
+        opts->timeout = left;
+    }
+    opts->echo = ask.echo;
+    answer->data[0] = '+';
+    answer->len = 1;
+    const int rc = paskuda_read_append(ask.message, opts, answer);
+    if (rc < 0 && errno != ETIMEDOUT)
+        read_failed();
+    if (rc == 0)
+        result = 0;
+    /* The file is not watched while reading, so the request may have been
+     * answered by another agent, or withdrawn, in the meantime. */
+    if (rc >= 0 && access(path, F_OK) < 0)
+        print_error(name, "request no longer pending");
+    else if (rc == 0)
+        ask_reply(ask.socket, "-", 1);
+    else if (rc > 0)
+        ask_reply(ask.socket, answer->data, answer->len);
+    paskuda_wipe(answer->data, answer->len);
+    answer->len = 0;
+out:
+    free(data);
+    return result;
+}
+
+static int ask_seen(char **names, size_t n, const char *name)
+{
+    for (size_t i = 0; i < n; i++)
+        if (strcmp(names[i], name) == 0)
+            return 1;
+    return 0;
+}
+
+/* Answer requests one after another, in a single terminal session,
+ * until end of input. */
+static void run_ask_password_agent(struct paskuda_opts *opts)
+{
+    int ifd = inotify_init1(IN_CLOEXEC);
+    if (ifd < 0)
+        xerror("inotify_init1()");
+    if (inotify_add_watch(ifd, ASK_PASSWORD_DIR, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+        xerror(ASK_PASSWORD_DIR);
+    struct paskuda_secret *answer = paskuda_alloc(opts->max_size + 1);
+    if (answer == NULL || paskuda_reserve(answer, 2) < 0)
+        xerror("paskuda_alloc()");
+    opts->keep_tty = 1;
+    /* requests already handled, whose files may still be around */
+    char **done = NULL;
+    size_t n_done = 0;
+    int more = 1;
+    while (more) {
+        DIR *dir = opendir(ASK_PASSWORD_DIR);
+        if (dir == NULL)
+            xerror(ASK_PASSWORD_DIR);
+        char **names = NULL;
+        size_t n_names = 0;
+        struct dirent *d;
+        while ((d = readdir(dir)) != NULL) {
+            if (strncmp(d->d_name, "ask.", 4) != 0)
+                continue;
+            char **p = realloc(names, (n_names + 1) * sizeof *names);
+            if (p == NULL || (p[n_names] = strdup(d->d_name)) == NULL)
+                xerror("malloc()");
+            names = p;
+            n_names++;
+        }
+        closedir(dir);
+        for (size_t i = 0; i < n_names && more; i++)
+            if (!ask_seen(done, n_done, names[i]))
+                more = ask_handle(names[i], answer, opts);
+        for (size_t i = 0; i < n_done; i++)
+            free(done[i]);
+        free(done);
+        done = names;
+        n_done = n_names;
+        if (!more)
+            break;
+        /* any event is a reason to rescan */
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        while (read(ifd, buf, sizeof buf) < 0)
+            if (errno != EINTR)
+                xerror("read()");
+    }
+    for (size_t i = 0; i < n_done; i++)
+        free(done[i]);
+    free(done);
+    paskuda_end();
+    paskuda_free(answer);
+    close(ifd);
+}
 
-static enum {
-    STATE_INIT,
-    STATE_ECHO,
-    STATE_NO_ECHO,
-} state = STATE_INIT;
+#endif
 
 int main(int argc, char **argv)
 {
+    static const struct option long_options[] = {
+        { "agent", no_argument, NULL, 'a' },
+        { "ansi", no_argument, NULL, 'A' },
+        { "ask-password-agent", no_argument, NULL, 'W' },
+        { "cache", no_argument, NULL, 'c' },
+        { "confirm", no_argument, NULL, 'C' },
+        { "count", required_argument, NULL, 'n' },
+        { "fd", required_argument, NULL, 'd' },
+        { "field", required_argument, NULL, 'f' },
+        { "format", required_argument, NULL, 'O' },
+        { "hash", required_argument, NULL, 'H' },
+        { "max-size", required_argument, NULL, 'M' },
+        { "memfd", no_argument, NULL, 'F' },
+        { "key", required_argument, NULL, 'k' },
+        { "keyring", no_argument, NULL, 'K' },
+        { "prompt-file", required_argument, NULL, 'P' },
+        { "salt", required_argument, NULL, 'Z' },
+        { "socket", required_argument, NULL, 'S' },
+        { "stats", no_argument, NULL, 's' },
+        { "timeout", required_argument, NULL, 'o' },
+        { "idle-timeout", required_argument, NULL, 'i' },
+        { "trace-fd", required_argument, NULL, 'D' },
+        { "ttl", required_argument, NULL, 't' },
+        { "typeahead", no_argument, NULL, 'T' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    struct paskuda_opts opts = {
+        .max_size = 64 << 10,
+    };
+    size_t count = 0;
+    struct field *fields = NULL;
+    size_t n_fields = 0;
+    const char *prompt_file = NULL;
+    int agent = 0;
+    int ask_agent = 0;
+    int cache = 0;
+    int confirm = 0;
+    int keyring = 0;
+    const char *cache_key = NULL;
+    const char *socket_path = NULL;
+    unsigned long ttl = 300;
+    int stats_fd = -1;
+    struct paskuda_stats stats;
+    unsigned long n;
+    for (int i = 1; i < argc; i++)
+        if (strcmp(argv[i], "--") == 0) {
+            output.command = argv + i + 1;
+            argv[i] = NULL;
+            argc = i;
+            break;
+        }
     int opt;
-    while ((opt = getopt(argc, argv, "h-:")) != -1)
+    while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1)
         switch (opt) {
+        case 'a':
+            agent = 1;
+            break;
+        case 'A':
+            opts.ansi = 1;
+            break;
+        case 'W':
+#ifndef __linux__
+            fatal("--ask-password-agent is supported only on Linux");
+#endif
+            ask_agent = 1;
+            break;
+        case 'c':
+            cache = 1;
+            break;
+        case 'C':
+            confirm = 1;
+            break;
+        case 'n':
+            if (parse_uint(optarg, SIZE_MAX, &n) < 0 || n == 0) {
+                show_usage(STDERR_FILENO);
+                exit(EXIT_FAILURE);
+            }
+            count = n;
+            break;
+        case 'M':
+            if (parse_size(optarg, &opts.max_size) < 0) {
+                show_usage(STDERR_FILENO);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'F':
+            output.memfd = 1;
+            break;
+        case 'd':
+            if (parse_uint(optarg, INT_MAX, &n) < 0) {
+                show_usage(STDERR_FILENO);
+                exit(EXIT_FAILURE);
+            }
+            output.fd = n;
+            break;
+        case 'f':
+            if (fields == NULL) {
+                fields = calloc(argc, sizeof *fields);
+                if (fields == NULL)
+                    xerror("calloc()");
+            }
+            if (parse_field(optarg, &fields[n_fields]) < 0) {
+                show_usage(STDERR_FILENO);
+                exit(EXIT_FAILURE);
+            }
+            n_fields++;
+            break;
+        case 'O':
+            if (parse_format(optarg) < 0) {
+                show_usage(STDERR_FILENO);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'H':
+            if (parse_hash(optarg) < 0) {
+                show_usage(STDERR_FILENO);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'Z':
+            hash.salt = optarg;
+            break;
+        case 'k':
+            cache = 1;
+            cache_key = optarg;
+            break;
+        case 'K':
+#ifndef __linux__
+            fatal("--keyring is supported only on Linux");
+#endif
+            cache = keyring = 1;
+            break;
+        case 'S':
+            socket_path = optarg;
+            break;
+        case 's':
+            if (stats_fd < 0)
+                stats_fd = STDERR_FILENO;
+            break;
+        case 'D':
+            if (parse_uint(optarg, INT_MAX, &n) < 0) {
+                show_usage(STDERR_FILENO);
+                exit(EXIT_FAILURE);
+            }
+            stats_fd = n;
+            break;
+        case 'T':
+            opts.typeahead = 1;
+            break;
+        case 'o':
+        case 'i':
+            if (parse_uint(optarg, INT32_MAX, &n) < 0) {
+                show_usage(STDERR_FILENO);
+                exit(EXIT_FAILURE);
+            }
+            *(opt == 'o' ? &opts.timeout : &opts.idle_timeout) = (long)n * 1000;
+            break;
+        case 't':
+            if (parse_uint(optarg, INT32_MAX, &ttl) < 0 || ttl == 0) {
+                show_usage(STDERR_FILENO);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'P':
+            prompt_file = optarg;
+            break;
         case 'h':
-            show_usage(stdout);
+            show_usage(STDOUT_FILENO);
             exit(EXIT_SUCCESS);
-        case '-':
-            if (strcmp(optarg, "help") == 0) {
-                show_usage(stdout);
-                exit(EXIT_SUCCESS);
-            }
-            /* fall through */
         default:
-            show_usage(stderr);
+            show_usage(STDERR_FILENO);
             exit(EXIT_FAILURE);
         }
     argc -= optind;
     argv += optind;
-    if (argc > 1) {
-        show_usage(stderr);
+    if (argc > 1 || (argc && prompt_file) || (output.command && output.command[0] == NULL)
+        || (agent && (argc || output.command || count || prompt_file || cache || confirm || hash.type))
+        || (ask_agent && (argc || agent || fields || output.command || count || prompt_file || cache || confirm || hash.type))
+        || (fields && (argc || agent || count || prompt_file || cache || confirm || output.format == FORMAT_RAW))) {
+        show_usage(STDERR_FILENO);
         exit(EXIT_FAILURE);
     }
-    if (argc)
-        prompt = argv[0];
-    init_tty(STDIN_FILENO);
-    const int fd = STDERR_FILENO;
-    xprintf(fd, "%s ", prompt);
-    xprintf(fd, "%s", msg_press_tab);
-    errno = EOVERFLOW;
-    const long page_size = sysconf(_SC_PAGESIZE);
-    if (page_size < 0)
-        xerror("sysconf(_SC_PAGESIZE)");
-    const size_t buf_size = page_size;
-    char *passwd = NULL;
-    int rc = posix_memalign((void **)&passwd, page_size, buf_size);
-    if (rc != 0) {
-        errno = rc;
-        xerror("posix_memalign()");
+    if (hash.type == HASH_ARGON2ID) {
+        if (hash.salt == NULL)
+            fatal("--hash=argon2id requires --salt");
+        if (strlen(hash.salt) < 8)
+            fatal("the salt must be at least 8 bytes long");
+        if (hash.argon2.m_cost / 8 < hash.argon2.lanes)
+            fatal("Argon2id needs at least 8K of memory per lane");
     }
-    rc = mlock(passwd, buf_size);
-    if (rc < 0)
-        xerror("mlock()");
+    const char *prompt = argc ? argv[0] : "Password:";
+    const int batch = count > 0 || prompt_file;
+    if (output.format == FORMAT_DEFAULT)
+        output.format = fields ? FORMAT_U32LE : batch ? FORMAT_NUL : FORMAT_RAW;
+    opts.keep_tty = batch;
+    if (stats_fd >= 0) {
+        /* rather than after the secret has been typed */
+        if (fcntl(stats_fd, F_GETFD) < 0)
+            xerror("--trace-fd");
+        if (stats_fd == (output.command ? output.fd : STDOUT_FILENO))
+            fatal("--trace-fd must not be where the secrets go");
+        opts.stats = &stats;
+    }
+    if (output.command)
+        output.sink = -1;
+    char **prompts = NULL;
+    if (prompt_file) {
+        size_t n;
+        prompts = read_prompts(prompt_file, &n);
+        if (count == 0)
+            count = n;
+        if (count > n)
+            fatal("not enough prompts in the prompt file");
+    }
+    if (count == 0)
+        count = 1;
+    if (cache_key && count > 1) {
+        /* only once the prompt file has been read */
+        show_usage(STDERR_FILENO);
+        exit(EXIT_FAILURE);
+    }
+    if (output.command && !output.memfd) {
+        /* room for every secret, or digest, with its frame */
+        const struct frame *f = NULL;
+        size_t size = opts.max_size < SHA256_SIZE ? SHA256_SIZE : opts.max_size;
+        size += sizeof f->header + sizeof f->trailer;
+        if (size > (SIZE_MAX - 1) / count)
+            fatal("--max-size too large");
+        output.queue = paskuda_alloc(size * count + 1);
+        if (output.queue == NULL)
+            xerror("paskuda_alloc()");
+    }
+    int rc;
 #ifdef __linux__
     rc = prctl(PR_SET_DUMPABLE, 0);
     if (rc < 0)
         xerror("prctl(PR_SET_DUMPABLE, 0)");
 #endif
-    size_t len = 0;
-    while (1) {
-        assert(len < buf_size);
-        int rc = read(STDIN_FILENO, passwd + len, 1);
-        register char c = passwd[len];
-        if (rc < 0)
-            xerror("read()");
-        if (rc == 0 || c == '\n')
-            break;
-        if (state == STATE_INIT) {
-            clear_s(fd, msg_press_tab);
-            msg_press_tab = NULL;
-            if (c == '\b' || c == 0x7F /* DEL */) {
-                xprintf(fd, "%s", msg_no_echo);
-                state = STATE_NO_ECHO;
+    if (agent || (cache && !keyring))
+        socket_path = agent_socket_path(socket_path);
+    if (agent) {
+        run_agent(socket_path, ttl, opts.max_size);
+        return EXIT_SUCCESS;
+    }
+#ifdef __linux__
+    if (ask_agent) {
+        run_ask_password_agent(&opts);
+        return EXIT_SUCCESS;
+    }
+#endif
+    if (fields) {
+        read_form(fields, n_fields, &opts, stats_fd);
+        return run_command();
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (prompts)
+            prompt = prompts[i];
+        const char *key = cache_key ? cache_key : prompt;
+        struct paskuda_secret *secret = NULL;
+        int cached = -1;
+        if (cache) {
+            secret = paskuda_alloc(opts.max_size);
+            if (secret == NULL)
+                xerror("paskuda_alloc()");
+            cached = keyring
+                ? keyring_get(key, secret)
+                : agent_get(socket_path, key, secret);
+            if (cached < 0) {
+                paskuda_free(secret);
+                secret = NULL;
+            }
+        }
+        if (secret == NULL) {
+            rc = confirm
+                ? read_confirmed(prompt, &opts, &secret)
+                : paskuda_read(prompt, &opts, &secret);
+            if (rc < 0)
+                read_failed();
+            if (rc == 0) {
+                if (count > 1 || prompts)
+                    fatal("unexpected end of input");
+                /* empty input is an empty secret */
+                emit("", 0);
                 continue;
             }
+        }
+        if (cache && cached < 0) {
+            if (keyring)
+                keyring_put(key, secret->data, secret->len, ttl);
             else
-                state = STATE_ECHO;
-        }
-        switch (c)
-        {
-        case '\b':
-        case 0x7F: // DEL
-            if (len) {
-                if (state == STATE_ECHO)
-                    clear_n(fd, 1);
-                len--;
-            } else
-                xprintf(fd, "\a");
-            break;
-        case 0x15: // ^U
-            clear_n(fd, len);
-            len = 0;
-            break;
-        case '\t':
-            if (state == STATE_ECHO) {
-                clear_n(fd, len);
-                xprintf(fd, "%s", msg_no_echo);
-            }
-            state = STATE_NO_ECHO;
-            break;
-        default:
-            if (len < buf_size - 1) {
-                len++;
-                if (state == STATE_ECHO)
-                    xprintf(fd, "*");
-            } else
-                xprintf(fd, "\a");
-        }
-    }
-    passwd[len] = '\0';
-    if (state == STATE_INIT)
-        clear_s(fd, msg_press_tab);
-    if (state == STATE_ECHO)
-        clear_n(fd, len);
-    xprintf(fd, "\n");
-    restore_tty();
-    xprintf(STDOUT_FILENO, "%s", passwd);
-    xmemset(passwd, '\0', buf_size);
-    free(passwd);
+                agent_put(socket_path, key, secret->data, secret->len);
+        }
+        emit(secret->data, secret->len);
+        paskuda_free(secret);
+        if (stats_fd >= 0 && cached < 0)
+            write_stats(stats_fd, &stats);
+    }
+    paskuda_end();
+    return run_command();
 }
 
 /* vim:set ts=4 sts=4 sw=4 et:*/
@@ -0,0 +1,87 @@
+/* Copyright © 2022-2024 Jakub Wilk <jwilk@jwilk.net>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef PASKUDA_H
+#define PASKUDA_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* I/O statistics for one paskuda_read(); times are in microseconds. */
+struct paskuda_stats {
+    unsigned long reads; /* read() calls on the input */
+    unsigned long read_bytes;
+    unsigned long max_read_bytes; /* the largest chunk read at once */
+    unsigned long writes; /* write() calls on the terminal */
+    unsigned long echo_bytes;
+    unsigned long read_us; /* time blocked waiting for input */
+    unsigned long write_us; /* time blocked writing to the terminal */
+    unsigned long typing_us; /* from the first input to the newline */
+};
+
+/* A zero-initialized struct gives the defaults. */
+struct paskuda_opts {
+    size_t max_size; /* largest secret accepted (0 means 64K) */
+    int ansi; /* erase using ANSI sequences: 1 = always, -1 = never, 0 = guess from $TERM */
+    int typeahead; /* keep input typed before the prompt and after the secret */
+    int keep_tty; /* leave the terminal set up for the next paskuda_read() */
+    int echo; /* echo the input as typed, e.g. for a user name */
+    long timeout; /* give up if the secret is not entered within this many ms (0 means never) */
+    long idle_timeout; /* give up after this many ms without input (0 means never) */
+    struct paskuda_stats *stats; /* if not NULL, filled in with I/O statistics */
+};
+
+/* A secret in locked memory that is wiped when freed;
+ * data is NUL-terminated. */
+struct paskuda_secret {
+    char *data;
+    size_t len;
+};
+
+/* Prompt for a secret on the terminal, or, if stdin is not a terminal, read
+ * a line from it. On success, return 1 and store the secret in *secret.
+ * At end of input, return 0. On error, return -1 and set errno (ETIMEDOUT
+ * if a timeout expired); the terminal is restored.
+ *
+ * Input that follows the newline in the same chunk is kept for the next
+ * call, and discarded by paskuda_end(); so, on a pipe, the rest of the
+ * chunk is consumed. A seekable stdin is instead repositioned just after
+ * the newline. With opts->typeahead, the terminal is read a byte at a time,
+ * so that nothing past the newline is consumed.
+ * The terminal state is per process, so calls must not overlap. */
+int paskuda_read(const char *prompt, const struct paskuda_opts *opts, struct paskuda_secret **secret);
+
+/* Like paskuda_read(), but append the secret to secret->data, which must
+ * have been allocated with paskuda_alloc(), and add its length to
+ * secret->len. Several secrets can be collected this way in a single
+ * buffer. On error, the appended data is wiped. */
+int paskuda_read_append(const char *prompt, const struct paskuda_opts *opts, struct paskuda_secret *secret);
+
+/* Allocate an empty secret that can grow up to max_size bytes.
+ * Return NULL and set errno on error. */
+struct paskuda_secret *paskuda_alloc(size_t max_size);
+
+/* Make sure that size bytes are available at secret->data.
+ * Return -1 and set errno (EMSGSIZE if size is above the limit) on error. */
+int paskuda_reserve(struct paskuda_secret *secret, size_t size);
+
+/* Wipe and free the secret; NULL is allowed. */
+void paskuda_free(struct paskuda_secret *secret);
+
+/* Clear n bytes at p, in a way that the compiler cannot optimize out. */
+void paskuda_wipe(void *p, size_t n);
+
+/* Restore the terminal and wipe input kept for the next paskuda_read(). */
+void paskuda_end(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim:set ts=4 sts=4 sw=4 et:*/
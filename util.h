@@ -0,0 +1,57 @@
+/* Copyright © 2024 Jakub Wilk <jwilk@jwilk.net>
+ * SPDX-License-Identifier: MIT
+ */
+
+/* Helpers shared by the library, the CLI and the hash code;
+ * not installed. */
+
+#ifndef PASKUDA_UTIL_H
+#define PASKUDA_UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/* Write n in decimal, without a terminator; return the length. */
+static inline size_t format_size(char *buf, size_t n)
+{
+    char tmp[24];
+    char *p = tmp + sizeof tmp;
+    do
+        *--p = '0' + n % 10;
+    while (n /= 10);
+    const size_t len = tmp + sizeof tmp - p;
+    memcpy(buf, p, len);
+    return len;
+}
+
+/* CLOCK_MONOTONIC cannot fail, short of a bad argument. */
+static inline int64_t monotonic_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline int64_t monotonic_ms()
+{
+    return monotonic_us() / 1000;
+}
+
+static inline uint32_t load32_le(const void *p)
+{
+    const unsigned char *u = p;
+    return (uint32_t)u[3] << 24 | (uint32_t)u[2] << 16 | (uint32_t)u[1] << 8 | u[0];
+}
+
+static inline void store32_le(void *p, uint32_t x)
+{
+    unsigned char *u = p;
+    for (int i = 0; i < 4; i++, x >>= 8)
+        u[i] = x;
+}
+
+#endif
+
+/* vim:set ts=4 sts=4 sw=4 et:*/